@@ -0,0 +1,304 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Number of independent replicas stepped together, one per 32-bit lane of the target's widest SIMD register.
+// A wider batch than the hardware vector is split by the compiler into slow element-wise code.
+#if defined(__AVX512F__)
+static const uint32_t BATCH_LANES = 16;
+#elif defined(__AVX2__)
+static const uint32_t BATCH_LANES = 8;
+#else
+static const uint32_t BATCH_LANES = 4;
+#endif
+
+// Worlds up to this many cells are small enough for the batched engine to keep all lanes in cache
+static const uint32_t BATCH_MAXIMUM_CELLS = 64 * 64;
+
+// One value per replica, held in one SIMD register (GCC vector extensions); comparisons give -1 in the lanes
+// where they hold and 0 elsewhere.
+typedef int32_t lanes_t __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+typedef uint32_t ulanes_t __attribute__((vector_size(BATCH_LANES * sizeof(uint32_t))));
+
+// Type of the border cells around a batched grid, never matched as empty or prey
+static const int32_t WALL = 4;
+
+inline lanes_t batch_splat(int32_t value) { return lanes_t{} + value; }
+
+inline bool batch_any(lanes_t mask)
+{
+    for (uint32_t l = 0; l < BATCH_LANES; l++)
+        if (mask[l])
+            return true;
+    return false;
+}
+
+// One xoshiro128** generator per lane, all advanced by the same vector instructions
+struct batch_rng_t
+{
+    ulanes_t s0{}, s1{}, s2{}, s3{};
+
+    void seed(uint32_t lane, std::seed_seq &seq)
+    {
+        uint32_t state[4];
+        seq.generate(state, state + 4);
+        s0[lane] = state[0], s1[lane] = state[1], s2[lane] = state[2], s3[lane] = state[3] | 1;
+    }
+
+    ulanes_t next()
+    {
+        ulanes_t x = s1 * 5;
+        ulanes_t out = ((x << 7) | (x >> 25)) * 9;
+        ulanes_t t = s1 << 9;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 11) | (s3 >> 21);
+        return out;
+    }
+};
+
+// A probability as a 32-bit threshold plus an "always" mask, so lanes compare without 64-bit arithmetic
+struct batch_probability_t
+{
+    uint32_t threshold;
+    int32_t always;
+
+    explicit batch_probability_t(uint64_t compiled = 0)
+        : threshold(compiled >= (1ull << 32) ? 0 : (uint32_t)compiled), always(compiled >= (1ull << 32) ? -1 : 0) {}
+
+    lanes_t test(ulanes_t draw) const { return (draw < threshold) | always; }
+};
+
+// Lanes where a draw passes the probability selected per lane between `herbivore_p` and `carnivore_p`
+inline lanes_t batch_test(ulanes_t draw, lanes_t is_herbivore, const batch_probability_t &herbivore_p, const batch_probability_t &carnivore_p)
+{
+    return is_herbivore ? herbivore_p.test(draw) : carnivore_p.test(draw);
+}
+
+// BATCH_LANES worlds of the same size, with every field laid out as [cell][replica] and a two cell wall border,
+// so every cell within reach of an entity exists and holds one lane vector
+struct batch_grid_t
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint32_t stride = 0; // Padded row length
+    std::vector<lanes_t> type;
+    std::vector<lanes_t> energy;
+    std::vector<lanes_t> age;
+    std::vector<lanes_t> acted;
+
+    void reset(uint32_t num_rows, uint32_t num_cols)
+    {
+        rows = num_rows;
+        cols = num_cols;
+        stride = cols + 4;
+        uint32_t padded = (rows + 4) * stride;
+        type.assign(padded, batch_splat(WALL));
+        energy.assign(padded, lanes_t{});
+        age.assign(padded, lanes_t{});
+        acted.assign(padded, lanes_t{});
+        for (uint32_t i = 0; i < rows; i++)
+            for (uint32_t j = 0; j < cols; j++)
+                type[cell(i, j)] = batch_splat(empty);
+    }
+
+    uint32_t cell(uint32_t i, uint32_t j) const { return (i + 2) * stride + j + 2; }
+
+    // Copies a scalar grid into one lane
+    void load(uint32_t lane, const grid_t &grid)
+    {
+        for (uint32_t i = 0; i < rows; i++)
+            for (uint32_t j = 0; j < cols; j++)
+            {
+                uint32_t src = grid.index(i, j), dst = cell(i, j);
+                type[dst][lane] = grid.type[src];
+                energy[dst][lane] = grid.energy[src];
+                age[dst][lane] = grid.age[src];
+            }
+    }
+
+    // Population of every lane
+    void count(population_t populations[BATCH_LANES]) const
+    {
+        lanes_t plants{}, herbivores{}, carnivores{};
+        for (uint32_t i = 0; i < rows; i++)
+            for (uint32_t j = 0; j < cols; j++)
+            {
+                lanes_t t = type[cell(i, j)];
+                plants -= t == (int32_t)plant;
+                herbivores -= t == (int32_t)herbivore;
+                carnivores -= t == (int32_t)carnivore;
+            }
+        for (uint32_t l = 0; l < BATCH_LANES; l++)
+            populations[l] = {(uint32_t)plants[l], (uint32_t)herbivores[l], (uint32_t)carnivores[l]};
+    }
+};
+
+// For every lane, picks uniformly one of the 4 neighbours of `cell` holding `wanted`: returns its direction
+// (0 up, 1 down, 2 left, 3 right, the scalar order) or 4 where there is none
+inline lanes_t batch_pick_neighbour(const batch_grid_t &grid, uint32_t cell, lanes_t wanted, ulanes_t draw)
+{
+    lanes_t m0 = grid.type[cell - grid.stride] == wanted;
+    lanes_t m1 = grid.type[cell + grid.stride] == wanted;
+    lanes_t m2 = grid.type[cell - 1] == wanted;
+    lanes_t m3 = grid.type[cell + 1] == wanted;
+    lanes_t count = -(m0 + m1 + m2 + m3);
+    lanes_t k = (lanes_t)(((draw >> 16) * (ulanes_t)count) >> 16);
+    lanes_t dir = (m2 & (k == -(m0 + m1))) ? batch_splat(2) : batch_splat(3);
+    dir = (m1 & (k == -m0)) ? batch_splat(1) : dir;
+    dir = (m0 & (k == 0)) ? batch_splat(0) : dir;
+    return count == 0 ? batch_splat(4) : dir;
+}
+
+// Sets `field` to `value` in the lanes where `mask` is set
+inline void batch_store(lanes_t &field, lanes_t mask, lanes_t value)
+{
+    field = mask ? value : field;
+}
+
+// Advances every lane by one step. Each lane follows exactly the rules of the scalar kernel, in the same cell
+// order; lanes only differ in their data, so every decision is a per-lane select instead of a branch, and
+// entities that land on a neighbour are written with one masked store per direction. A phase is skipped for
+// a cell only when no lane needs it.
+inline void batch_step(batch_grid_t &grid, const compiled_rules_t &rules, batch_rng_t &rng)
+{
+    const batch_probability_t plant_reproduction(rules.plant_reproduction_threshold);
+    const batch_probability_t herbivore_eat(rules.herbivore_eat_threshold), carnivore_eat(rules.carnivore_eat_threshold);
+    const batch_probability_t herbivore_move(rules.herbivore_move_threshold), carnivore_move(rules.carnivore_move_threshold);
+    const batch_probability_t herbivore_reproduction(rules.herbivore_reproduction_threshold), carnivore_reproduction(rules.carnivore_reproduction_threshold);
+    const int32_t S = grid.stride;
+    const int32_t offsets[4] = {-S, S, -1, 1};
+    const lanes_t zero{}, ones = batch_splat(1), none = batch_splat(empty);
+
+    std::fill(grid.acted.begin(), grid.acted.end(), zero);
+
+    for (uint32_t i = 0; i < grid.rows; i++)
+        for (uint32_t j = 0; j < grid.cols; j++)
+        {
+            const uint32_t c = grid.cell(i, j);
+            // The cell and its neighbours; position 0 is the cell itself, 1-4 the neighbour in direction 0-3
+            const uint32_t position[5] = {c, c - S, c + S, c - 1, c + 1};
+            lanes_t &T = grid.type[c], &E = grid.energy[c], &A = grid.age[c], &ACT = grid.acted[c];
+
+            // Ageing, and death of old age
+            lanes_t t = T;
+            lanes_t act = (t != (int32_t)empty) & (ACT == 0);
+            lanes_t age = A - act;
+            lanes_t maximum_age = (t == (int32_t)plant) ? batch_splat(rules.plant_maximum_age) : batch_splat(rules.carnivore_maximum_age);
+            maximum_age = (t == (int32_t)herbivore) ? batch_splat(rules.herbivore_maximum_age) : maximum_age;
+            lanes_t alive = act & (age < maximum_age);
+            lanes_t dies = act & ~alive;
+            lanes_t grow = alive & (t == (int32_t)plant);
+            lanes_t animal = alive & (t != (int32_t)plant);
+            lanes_t is_herbivore = t == (int32_t)herbivore;
+            ACT |= act & ones;
+            T = dies ? none : t;
+            E = dies ? zero : E;
+            A = dies ? zero : age;
+
+            // Plants grow into an adjacent empty cell
+            if (batch_any(grow))
+            {
+                ulanes_t draw = rng.next(), choice = rng.next();
+                lanes_t dir = batch_pick_neighbour(grid, c, none, choice);
+                grow &= plant_reproduction.test(draw) & (dir < 4);
+                for (int32_t k = 0; k < 4; k++)
+                {
+                    uint32_t n = c + offsets[k];
+                    lanes_t hit = grow & (dir == k);
+                    batch_store(grid.type[n], hit, batch_splat(plant));
+                    batch_store(grid.energy[n], hit, zero);
+                    batch_store(grid.age[n], hit, zero);
+                    batch_store(grid.acted[n], hit, ones);
+                }
+            }
+            if (!batch_any(animal))
+                continue;
+
+            // Animals eat an adjacent prey
+            ulanes_t draw = rng.next(), choice = rng.next();
+            lanes_t dir = batch_pick_neighbour(grid, c, is_herbivore ? batch_splat(plant) : batch_splat(herbivore), choice);
+            lanes_t eat = animal & (dir < 4) & batch_test(draw, is_herbivore, herbivore_eat, carnivore_eat);
+            // The gain is only added when it stays under the maximum, so gains up to INT32_MAX cannot overflow
+            lanes_t gain = is_herbivore ? batch_splat(rules.herbivore_eat_energy_gain) : batch_splat(rules.carnivore_eat_energy_gain);
+            lanes_t fed = gain < rules.maximum_energy - E ? E + gain : batch_splat(rules.maximum_energy);
+            lanes_t e = eat ? fed : E;
+            if (batch_any(eat))
+                for (int32_t k = 0; k < 4; k++)
+                {
+                    uint32_t n = c + offsets[k];
+                    lanes_t hit = eat & (dir == k);
+                    batch_store(grid.type[n], hit, none);
+                    batch_store(grid.energy[n], hit, zero);
+                    batch_store(grid.age[n], hit, zero);
+                }
+
+            // Animals move to an adjacent empty cell, which leaves this one empty
+            draw = rng.next(), choice = rng.next();
+            dir = batch_pick_neighbour(grid, c, none, choice);
+            lanes_t move = animal & (dir < 4) & batch_test(draw, is_herbivore, herbivore_move, carnivore_move);
+            // As in the scalar kernel, a move brings energy over the maximum, as from a larger initial energy, back to it
+            e -= move & rules.move_energy_cost;
+            e = (move & (e > rules.maximum_energy)) ? batch_splat(rules.maximum_energy) : e;
+            lanes_t pos = move ? dir + 1 : zero;
+            if (batch_any(move))
+            {
+                for (int32_t k = 0; k < 4; k++)
+                {
+                    uint32_t n = c + offsets[k];
+                    lanes_t hit = move & (dir == k);
+                    batch_store(grid.type[n], hit, T);
+                    batch_store(grid.age[n], hit, A);
+                    batch_store(grid.acted[n], hit, ones);
+                }
+                batch_store(T, move, none);
+                batch_store(E, move, zero);
+                batch_store(A, move, zero);
+            }
+
+            // Animals with enough energy reproduce next to wherever they are now
+            draw = rng.next(), choice = rng.next();
+            lanes_t reproduce = animal & (e > rules.threshold_energy_for_reproduction) &
+                                batch_test(draw, is_herbivore, herbivore_reproduction, carnivore_reproduction);
+            if (batch_any(reproduce))
+            {
+                lanes_t offspring = is_herbivore ? batch_splat(herbivore) : batch_splat(carnivore);
+                for (int32_t p = 0; p < 5; p++)
+                {
+                    lanes_t here = reproduce & (pos == p);
+                    if (!batch_any(here))
+                        continue;
+                    dir = batch_pick_neighbour(grid, position[p], none, choice);
+                    for (int32_t k = 0; k < 4; k++)
+                    {
+                        uint32_t n = position[p] + offsets[k];
+                        lanes_t hit = here & (dir == k);
+                        e -= hit & rules.reproduction_energy_cost;
+                        batch_store(grid.type[n], hit, offspring);
+                        batch_store(grid.energy[n], hit, batch_splat(rules.initial_energy));
+                        batch_store(grid.age[n], hit, zero);
+                        batch_store(grid.acted[n], hit, ones);
+                    }
+                }
+            }
+
+            // Write back the energy, starving animals that ran out of it
+            lanes_t starves = e <= 0;
+            e = starves ? zero : e;
+            for (int32_t p = 0; p < 5; p++)
+            {
+                lanes_t here = animal & (pos == p);
+                batch_store(grid.energy[position[p]], here, e);
+                batch_store(grid.type[position[p]], here & starves, none);
+                batch_store(grid.age[position[p]], here & starves, zero);
+            }
+        }
+}
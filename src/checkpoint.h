@@ -0,0 +1,381 @@
+#pragma once
+
+#include "session.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Checkpoint file layout (native byte order):
+//   header: magic, version, rows, cols, tile rows, number of rule parameters, flags (from version 2)
+//   records, appended one per checkpoint:
+//     record magic, step, recording (start parameters, seed, initial rules, edits), current rules,
+//     generator state (count-prefixed words), tile count, then per tile its index and the
+//     type, energy and age arrays of its cells
+// A tile is a band of CHECKPOINT_TILE_ROWS rows, contiguous in the grid arrays. The first record holds
+// every tile, later ones only those whose hash changed since the previous checkpoint, so restoring replays
+// the records in order.
+static const char CHECKPOINT_MAGIC[8] = {'E', 'C', 'O', 'S', 'I', 'M', 'C', 'K'};
+static const uint32_t CHECKPOINT_VERSION = 2;
+static const uint32_t CHECKPOINT_MAPPED = 1; // Flag of a session whose grid lives in a memory-mapped file
+static const uint32_t CHECKPOINT_RECORD_MAGIC = 0x44524352; // "RCRD"
+static const uint32_t CHECKPOINT_TILE_ROWS = 8;
+
+struct checkpoint_result_t
+{
+    uint64_t step = 0;
+    uint32_t tiles = 0;   // Tiles in the grid
+    uint32_t written = 0; // Tiles written by this checkpoint
+    uint64_t bytes = 0;   // Size of the record
+};
+
+class binary_writer_t
+{
+public:
+    explicit binary_writer_t(std::ostream &out) : out(out) {}
+
+    template <typename T>
+    void value(const T &v) { bytes(&v, sizeof(v)); }
+
+    void bytes(const void *data, size_t size) { out.write((const char *)data, size); }
+
+private:
+    std::ostream &out;
+};
+
+class binary_reader_t
+{
+public:
+    explicit binary_reader_t(std::istream &in) : in(in) {}
+
+    template <typename T>
+    bool value(T &v) { return bytes(&v, sizeof(v)); }
+
+    bool bytes(void *data, size_t size) { return (bool)in.read((char *)data, size); }
+
+private:
+    std::istream &in;
+};
+
+inline void write_rules(binary_writer_t &writer, const rule_set_t &rules)
+{
+    for (auto &parameter : RULE_PARAMETERS)
+        writer.value(parameter.integer ? (double)(rules.*parameter.integer) : rules.*parameter.probability);
+}
+
+inline bool read_rules(binary_reader_t &reader, rule_set_t &rules)
+{
+    for (auto &parameter : RULE_PARAMETERS)
+    {
+        double value;
+        if (!reader.value(value))
+            return false;
+        set_rule_parameter(rules, parameter, value);
+    }
+    return true;
+}
+
+// The generator state is only exposed as text, a list of words; it is stored as the words themselves
+inline void write_generator(binary_writer_t &writer, const std::mt19937 &gen)
+{
+    std::stringstream text;
+    text << gen;
+    std::vector<uint32_t> words;
+    for (uint32_t word; text >> word;)
+        words.push_back(word);
+    writer.value((uint32_t)words.size());
+    writer.bytes(words.data(), words.size() * sizeof(uint32_t));
+}
+
+inline bool read_generator(binary_reader_t &reader, std::mt19937 &gen)
+{
+    uint32_t size;
+    if (!reader.value(size) || size != std::mt19937::state_size + 1)
+        return false;
+    std::vector<uint32_t> words(size);
+    if (!reader.bytes(words.data(), size * sizeof(uint32_t)))
+        return false;
+    std::stringstream text;
+    for (uint32_t word : words)
+        text << word << ' ';
+    text >> gen;
+    return (bool)text;
+}
+
+inline void write_recording(binary_writer_t &writer, const recording_t &recording)
+{
+    writer.value(recording.plants);
+    writer.value(recording.herbivores);
+    writer.value(recording.carnivores);
+    writer.value(recording.seed);
+    write_rules(writer, recording.rules);
+    writer.value((uint32_t)recording.edits.size());
+    for (auto &edit : recording.edits)
+    {
+        writer.value(edit.step);
+        writer.value((uint32_t)edit.cells.size());
+        for (auto &cell : edit.cells)
+        {
+            writer.value(cell.row);
+            writer.value(cell.col);
+            writer.value(cell.entity.type);
+            writer.value(cell.entity.energy);
+            writer.value(cell.entity.age);
+        }
+        writer.value((uint32_t)edit.rules.size());
+        for (auto &parameter : edit.rules)
+        {
+            writer.value((uint32_t)(parameter.first - RULE_PARAMETERS));
+            writer.value(parameter.second);
+        }
+    }
+}
+
+inline bool read_recording(binary_reader_t &reader, recording_t &recording)
+{
+    uint32_t num_edits;
+    if (!reader.value(recording.plants) || !reader.value(recording.herbivores) || !reader.value(recording.carnivores) ||
+        !reader.value(recording.seed) || !read_rules(reader, recording.rules) || !reader.value(num_edits))
+        return false;
+    recording.edits.clear();
+    for (uint32_t e = 0; e < num_edits; e++)
+    {
+        session_edit_t edit;
+        uint32_t num_cells, num_rules;
+        if (!reader.value(edit.step) || !reader.value(num_cells))
+            return false;
+        for (uint32_t k = 0; k < num_cells; k++)
+        {
+            cell_edit_t cell;
+            if (!reader.value(cell.row) || !reader.value(cell.col) || !reader.value(cell.entity.type) ||
+                !reader.value(cell.entity.energy) || !reader.value(cell.entity.age) ||
+                cell.row >= recording.rows || cell.col >= recording.cols || cell.entity.type > carnivore)
+                return false;
+            edit.cells.push_back(cell);
+        }
+        if (!reader.value(num_rules))
+            return false;
+        for (uint32_t k = 0; k < num_rules; k++)
+        {
+            uint32_t index;
+            double value;
+            if (!reader.value(index) || !reader.value(value) || index >= std::size(RULE_PARAMETERS))
+                return false;
+            edit.rules.emplace_back(&RULE_PARAMETERS[index], value);
+        }
+        recording.edits.push_back(std::move(edit));
+    }
+    return true;
+}
+
+// First cell and number of cells of tile `t`
+inline void tile_range(const grid_t &grid, uint32_t t, uint32_t &first, uint32_t &count)
+{
+    uint32_t row = t * CHECKPOINT_TILE_ROWS;
+    first = row * grid.cols;
+    count = std::min(CHECKPOINT_TILE_ROWS, grid.rows - row) * grid.cols;
+}
+
+inline uint32_t tile_count(const grid_t &grid) { return (grid.rows + CHECKPOINT_TILE_ROWS - 1) / CHECKPOINT_TILE_ROWS; }
+
+// Fingerprint of a tile's contents, so unchanged tiles are found without keeping a copy of the grid
+inline uint64_t tile_hash(const grid_t &grid, uint32_t t)
+{
+    uint32_t first, count;
+    tile_range(grid, t, first, count);
+    std::hash<std::string_view> hash;
+    uint64_t h = hash(std::string_view((const char *)&grid.type[first], count * sizeof(grid.type[0])));
+    h = h * 0x9E3779B97F4A7C15ull ^ hash(std::string_view((const char *)&grid.energy[first], count * sizeof(grid.energy[0])));
+    h = h * 0x9E3779B97F4A7C15ull ^ hash(std::string_view((const char *)&grid.age[first], count * sizeof(grid.age[0])));
+    return h;
+}
+
+// Appends a checkpoint of the session to `path`. With `full`, or when the session has no checkpoint in
+// that file yet, the file is started over with every tile, written aside and renamed over the old one so that
+// a crash leaves either; otherwise only the tiles that changed since the session's previous checkpoint are
+// appended. Returns false if the file cannot be written; a record appended in part is then cut off again, since
+// restoring stops at the first incomplete record and would miss every later one, and the next checkpoint is a
+// full one in case the file could not be cut.
+inline bool write_checkpoint(session_t &session, const std::string &path, bool full, checkpoint_result_t &result)
+{
+    std::lock_guard<std::mutex> lock(session.mutex);
+    const grid_t &grid = session.grid;
+    full = full || session.checkpoint_path != path || session.checkpoint_hashes.size() != tile_count(grid);
+
+    std::string target = full ? path + ".tmp" : path;
+    std::ofstream out(target, full ? std::ios::binary | std::ios::trunc : std::ios::binary | std::ios::app);
+    if (!out)
+        return false;
+    binary_writer_t writer(out);
+    if (full)
+    {
+        writer.bytes(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        writer.value(CHECKPOINT_VERSION);
+        writer.value(grid.rows);
+        writer.value(grid.cols);
+        writer.value(CHECKPOINT_TILE_ROWS);
+        writer.value((uint32_t)std::size(RULE_PARAMETERS));
+        writer.value(grid.mapped() ? CHECKPOINT_MAPPED : 0u);
+    }
+    auto start = out.tellp();
+
+    writer.value(CHECKPOINT_RECORD_MAGIC);
+    writer.value(session.step);
+    write_recording(writer, session.recording);
+    write_rules(writer, session.rules.source);
+    write_generator(writer, session.gen);
+
+    std::vector<uint64_t> hashes(tile_count(grid));
+    std::vector<uint32_t> tiles;
+    for (uint32_t t = 0; t < tile_count(grid); t++)
+    {
+        hashes[t] = tile_hash(grid, t);
+        if (full || hashes[t] != session.checkpoint_hashes[t])
+            tiles.push_back(t);
+    }
+    writer.value((uint32_t)tiles.size());
+    for (uint32_t t : tiles)
+    {
+        uint32_t first, count;
+        tile_range(grid, t, first, count);
+        writer.value(t);
+        writer.bytes(&grid.type[first], count * sizeof(grid.type[0]));
+        writer.bytes(&grid.energy[first], count * sizeof(grid.energy[0]));
+        writer.bytes(&grid.age[first], count * sizeof(grid.age[0]));
+    }
+    out.flush();
+    bool written = (bool)out;
+    if (written)
+        result = {session.step, tile_count(grid), (uint32_t)tiles.size(), (uint64_t)(out.tellp() - start)};
+    out.close();
+    if (written && (!full || std::rename(target.c_str(), path.c_str()) == 0))
+    {
+        session.checkpoint_path = path;
+        session.checkpoint_hashes = std::move(hashes);
+        return true;
+    }
+
+    std::error_code error;
+    if (full)
+        std::filesystem::remove(target, error);
+    else if (start >= 0)
+        std::filesystem::resize_file(path, start, error);
+    session.checkpoint_path.clear();
+    return false;
+}
+
+// Reads a record up to its tile count
+inline bool read_record_header(binary_reader_t &reader, uint64_t &step, recording_t &recording, rule_set_t &rules, std::mt19937 &gen,
+                               uint32_t &num_tiles)
+{
+    uint32_t record_magic;
+    return reader.value(record_magic) && record_magic == CHECKPOINT_RECORD_MAGIC && reader.value(step) && read_recording(reader, recording) &&
+           read_rules(reader, rules) && read_generator(reader, gen) && reader.value(num_tiles);
+}
+
+// Restores a session from the records of a checkpoint file, tiles being read straight into the grid arrays. A
+// last record cut short, as by a crash while appending it, is left out. The grid of a session that was mapped is
+// mapped again, to a scratch file in `mapped_directory`. Later checkpoints of the session keep appending to the
+// same file. Returns false on a missing, foreign or corrupt file.
+inline bool read_checkpoint(session_t &session, const std::string &path, const std::string &mapped_directory)
+{
+    std::ifstream in(path, std::ios::binary);
+    binary_reader_t reader(in);
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint32_t version, rows, cols, tile_rows, num_parameters, flags = 0;
+    if (!reader.bytes(magic, sizeof(magic)) || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+        !reader.value(version) || (version != 1 && version != CHECKPOINT_VERSION) || !reader.value(rows) || !reader.value(cols) ||
+        !reader.value(tile_rows) || tile_rows != CHECKPOINT_TILE_ROWS || !reader.value(num_parameters) ||
+        num_parameters != std::size(RULE_PARAMETERS) || (version >= 2 && !reader.value(flags)) ||
+        rows == 0 || cols == 0 || (uint64_t)rows * cols >= NO_CELL)
+        return false;
+
+    // First find where the complete records end, skipping over the tiles
+    std::streamoff records = in.tellg(), complete = records;
+    in.seekg(0, std::ios::end);
+    std::streamoff file_size = in.tellg();
+    in.seekg(records);
+    {
+        uint64_t step;
+        recording_t recording;
+        recording.rows = rows;
+        recording.cols = cols;
+        rule_set_t rules;
+        std::mt19937 gen;
+        uint32_t num_tiles, num_grid_tiles = (rows + CHECKPOINT_TILE_ROWS - 1) / CHECKPOINT_TILE_ROWS;
+        while (read_record_header(reader, step, recording, rules, gen, num_tiles))
+        {
+            uint32_t k = 0;
+            for (uint32_t t; k < num_tiles && reader.value(t) && t < num_grid_tiles; k++)
+            {
+                uint64_t cells = (uint64_t)std::min(CHECKPOINT_TILE_ROWS, rows - t * CHECKPOINT_TILE_ROWS) * cols;
+                in.seekg(cells * (sizeof(entity_type_t) + 2 * sizeof(int32_t)), std::ios::cur);
+                if (!in || in.tellg() > file_size)
+                    break;
+            }
+            if (k < num_tiles)
+                break;
+            complete = in.tellg();
+        }
+    }
+    if (complete == records)
+        return false;
+    in.clear();
+    in.seekg(records);
+
+    std::lock_guard<std::mutex> lock(session.mutex);
+    grid_t &grid = session.grid;
+    if (flags & CHECKPOINT_MAPPED)
+    {
+        if (!grid.map_file(mapped_directory, rows, cols))
+            return false;
+    }
+    else
+        grid.reset(rows, cols);
+    session.recording.rows = rows;
+    session.recording.cols = cols;
+    while (in.tellg() < complete)
+    {
+        rule_set_t rules;
+        uint32_t num_tiles;
+        if (!read_record_header(reader, session.step, session.recording, rules, session.gen, num_tiles))
+            return false;
+        session.rules = compiled_rules_t(rules);
+        for (uint32_t k = 0; k < num_tiles; k++)
+        {
+            uint32_t t, first, count;
+            if (!reader.value(t) || t >= tile_count(grid))
+                return false;
+            tile_range(grid, t, first, count);
+            if (!reader.bytes(&grid.type[first], count * sizeof(grid.type[0])) ||
+                !reader.bytes(&grid.energy[first], count * sizeof(grid.energy[0])) ||
+                !reader.bytes(&grid.age[first], count * sizeof(grid.age[0])))
+                return false;
+        }
+    }
+    for (auto type : grid.type)
+        if (type > carnivore)
+            return false;
+
+    // A session checkpointed while replaying still has the recorded edits after its step to apply
+    session.replay.clear();
+    for (auto &edit : session.recording.edits)
+        if (edit.step > session.step)
+            session.replay.push_back(edit);
+
+    grid.track_histograms(session.rules.source);
+    grid.recount();
+    session.publish_stats(true);
+    session.revision++;
+    session.checkpoint_path = path;
+    session.checkpoint_hashes.resize(tile_count(grid));
+    for (uint32_t t = 0; t < tile_count(grid); t++)
+        session.checkpoint_hashes[t] = tile_hash(grid, t);
+    return true;
+}
@@ -3721,10 +3721,15 @@ namespace crow
         {
             virtual void send_binary(const std::string& msg) = 0;
             virtual void send_text(const std::string& msg) = 0;
+            virtual void send_shared(std::shared_ptr<const std::string> msg, bool binary) = 0;
             virtual void send_ping(const std::string& msg) = 0;
             virtual void send_pong(const std::string& msg) = 0;
             virtual void close(const std::string& msg = "quit") = 0;
             virtual std::string get_remote_ip() = 0;
+            /// Bytes queued for sending and not written to the socket yet; may be read from any thread.
+            virtual size_t queued_bytes() const = 0;
+            /// Calls `handler` once, on the connection's thread, as soon as nothing is queued for sending.
+            virtual void when_drained(std::function<void()> handler) = 0;
             virtual ~connection() {}
 
             void userdata(void* u) { userdata_ = u; }
@@ -3823,10 +3828,12 @@ namespace crow
             /// Usually invoked to check if the other point is still online.
             void send_ping(const std::string& msg) override
             {
-                dispatch([this, msg] {
+                dispatch([this, msg, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
                     auto header = build_header(0x9, msg.size());
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(msg);
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
                     do_write();
                 });
             }
@@ -3837,10 +3844,12 @@ namespace crow
             /// Usually automatically invoked as a response to a "Ping" message.
             void send_pong(const std::string& msg) override
             {
-                dispatch([this, msg] {
+                dispatch([this, msg, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
                     auto header = build_header(0xA, msg.size());
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(msg);
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
                     do_write();
                 });
             }
@@ -3848,10 +3857,12 @@ namespace crow
             /// Send a binary encoded message.
             void send_binary(const std::string& msg) override
             {
-                dispatch([this, msg] {
+                dispatch([this, msg, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
                     auto header = build_header(2, msg.size());
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(msg);
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
                     do_write();
                 });
             }
@@ -3859,10 +3870,25 @@ namespace crow
             /// Send a plaintext message.
             void send_text(const std::string& msg) override
             {
-                dispatch([this, msg] {
+                dispatch([this, msg, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
                     auto header = build_header(1, msg.size());
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(msg);
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
+                    do_write();
+                });
+            }
+
+            /// Send a message whose buffer may be shared with other connections, without copying it.
+            void send_shared(std::shared_ptr<const std::string> msg, bool binary) override
+            {
+                dispatch([this, msg, binary, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
+                    auto header = build_header(binary ? 2 : 1, msg->size());
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
                     do_write();
                 });
             }
@@ -3873,7 +3899,9 @@ namespace crow
             /// Sets a flag to destroy the object once the message is sent.
             void close(const std::string& msg) override
             {
-                dispatch([this, msg] {
+                dispatch([this, msg, watch = std::weak_ptr<void>(anchor_)] {
+                    if (!watch.lock())
+                        return;
                     has_sent_close_ = true;
                     if (has_recv_close_ && !is_close_handler_called_)
                     {
@@ -3882,8 +3910,8 @@ namespace crow
                             close_handler_(*this, msg);
                     }
                     auto header = build_header(0x8, msg.size());
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(msg);
+                    queue_buffer(std::move(header));
+                    queue_buffer(msg);
                     do_write();
                 });
             }
@@ -3893,6 +3921,23 @@ namespace crow
                 return adaptor_.remote_endpoint().address().to_string();
             }
 
+            size_t queued_bytes() const override
+            {
+                return queued_bytes_;
+            }
+
+            void when_drained(std::function<void()> handler) override
+            {
+                dispatch([this, handler = std::move(handler), watch = std::weak_ptr<void>(anchor_)]() mutable {
+                    if (!watch.lock())
+                        return;
+                    if (queued_bytes_ == 0)
+                        handler();
+                    else
+                        drain_handler_ = std::move(handler);
+                });
+            }
+
         protected:
             /// Generate the websocket headers using an opcode and the message size (in bytes).
             std::string build_header(int opcode, size_t size)
@@ -3928,10 +3973,10 @@ namespace crow
                                             "Upgrade: websocket\r\n"
                                             "Connection: Upgrade\r\n"
                                             "Sec-WebSocket-Accept: ";
-                write_buffers_.emplace_back(header);
-                write_buffers_.emplace_back(std::move(hello));
-                write_buffers_.emplace_back(crlf);
-                write_buffers_.emplace_back(crlf);
+                queue_buffer(header);
+                queue_buffer(std::move(hello));
+                queue_buffer(crlf);
+                queue_buffer(crlf);
                 do_write();
                 if (open_handler_)
                     open_handler_(*this);
@@ -4270,18 +4315,27 @@ namespace crow
                     sending_buffers_.swap(write_buffers_);
                     std::vector<boost::asio::const_buffer> buffers;
                     buffers.reserve(sending_buffers_.size());
+                    size_t bytes = 0;
                     for (auto& s : sending_buffers_)
                     {
-                        buffers.emplace_back(boost::asio::buffer(s));
+                        buffers.emplace_back(boost::asio::buffer(s.get()));
+                        bytes += s.get().size();
                     }
                     boost::asio::async_write(
                       adaptor_.socket(), buffers,
-                      [&](const boost::system::error_code& ec, std::size_t /*bytes_transferred*/) {
+                      [&, bytes](const boost::system::error_code& ec, std::size_t /*bytes_transferred*/) {
                           sending_buffers_.clear();
+                          queued_bytes_ -= bytes;
                           if (!ec && !close_connection_)
                           {
                               if (!write_buffers_.empty())
                                   do_write();
+                              else if (drain_handler_)
+                              {
+                                  auto handler = std::move(drain_handler_);
+                                  drain_handler_ = nullptr;
+                                  handler();
+                              }
                               if (has_sent_close_)
                                   close_connection_ = true;
                           }
@@ -4308,8 +4362,26 @@ namespace crow
         private:
             Adaptor adaptor_;
 
-            std::vector<std::string> sending_buffers_;
-            std::vector<std::string> write_buffers_;
+            /// A buffer to write, owned by the connection or shared with others.
+            struct write_buffer
+            {
+                write_buffer(std::string s): owned(std::move(s)) {}
+                write_buffer(std::shared_ptr<const std::string> s): shared(std::move(s)) {}
+                const std::string& get() const { return shared ? *shared : owned; }
+
+                std::string owned;
+                std::shared_ptr<const std::string> shared;
+            };
+            std::vector<write_buffer> sending_buffers_;
+            std::vector<write_buffer> write_buffers_;
+            std::atomic<size_t> queued_bytes_{0};
+            std::function<void()> drain_handler_;
+
+            void queue_buffer(write_buffer buffer)
+            {
+                queued_bytes_ += buffer.get().size();
+                write_buffers_.emplace_back(std::move(buffer));
+            }
 
             boost::array<char, 4096> buffer_;
             bool is_binary_;
@@ -4328,6 +4400,8 @@ namespace crow
             bool error_occured_{false};
             bool pong_received_{false};
             bool is_close_handler_called_{false};
+            // Expires with the connection, so that sends queued from other threads are dropped once it is gone
+            std::shared_ptr<void> anchor_ = std::make_shared<int>(0);
 
             std::function<void(crow::websocket::connection&)> open_handler_;
             std::function<void(crow::websocket::connection&, const std::string&, bool)> message_handler_;
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "batch.h"
+#include "scheduler.h"
+#include "sketch.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Streaming estimate of one quantile in constant memory (P-square algorithm, Jain & Chlamtac 1985)
+class p2_quantile_t
+{
+public:
+    explicit p2_quantile_t(double p = 0.5) : p(p) {}
+
+    void add(double x)
+    {
+        if (count < 5)
+        {
+            q[count++] = x;
+            if (count == 5)
+            {
+                std::sort(q, q + 5);
+                for (int i = 0; i < 5; i++)
+                    n[i] = i + 1;
+                np[0] = 1, np[1] = 1 + 2 * p, np[2] = 1 + 4 * p, np[3] = 3 + 2 * p, np[4] = 5;
+            }
+            return;
+        }
+        count++;
+
+        int k;
+        if (x < q[0])
+            q[0] = x, k = 0;
+        else if (x >= q[4])
+            q[4] = x, k = 3;
+        else
+            for (k = 0; x >= q[k + 1]; k++)
+                ;
+        for (int i = k + 1; i < 5; i++)
+            n[i]++;
+        const double dn[5] = {0, p / 2, p, (1 + p) / 2, 1};
+        for (int i = 0; i < 5; i++)
+            np[i] += dn[i];
+
+        // Move the middle markers towards their desired positions
+        for (int i = 1; i < 4; i++)
+        {
+            double d = np[i] - n[i];
+            if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1))
+            {
+                int s = d > 0 ? 1 : -1;
+                double parabolic = q[i] + s / (n[i + 1] - n[i - 1]) *
+                                              ((n[i] - n[i - 1] + s) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                                               (n[i + 1] - n[i] - s) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+                if (q[i - 1] < parabolic && parabolic < q[i + 1])
+                    q[i] = parabolic;
+                else
+                    q[i] += s * (q[i + s] - q[i]) / (n[i + s] - n[i]);
+                n[i] += s;
+            }
+        }
+    }
+
+    double value() const
+    {
+        if (count >= 5)
+            return q[2];
+        if (count == 0)
+            return 0;
+        // Too few samples for the markers, use the exact quantile
+        double sorted[5];
+        std::copy(q, q + count, sorted);
+        std::sort(sorted, sorted + count);
+        return sorted[std::min<uint32_t>(count - 1, (uint32_t)std::floor(p * count))];
+    }
+
+private:
+    double p;
+    uint32_t count = 0;
+    double q[5] = {};
+    double n[5] = {};
+    double np[5] = {};
+};
+
+// Streaming mean, variance (Welford) and quantiles of one value
+struct running_stats_t
+{
+    uint64_t count = 0;
+    double mean = 0;
+    double m2 = 0;
+    p2_quantile_t p05{0.05}, p50{0.5}, p95{0.95};
+
+    void add(double x)
+    {
+        count++;
+        double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+        p05.add(x);
+        p50.add(x);
+        p95.add(x);
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+};
+
+// Initial conditions shared by every replica of an ensemble
+struct ensemble_config_t
+{
+    uint32_t rows = NUM_ROWS;
+    uint32_t cols = NUM_ROWS;
+    uint32_t plants = 0;
+    uint32_t herbivores = 0;
+    uint32_t carnivores = 0;
+    uint32_t steps = 0;
+    rule_set_t rules;
+};
+
+// Cell updates a replica runs in one slice of a background task, before its worker goes back to any session step
+// that became runnable meanwhile
+static const uint64_t REPLICA_SLICE_CELLS = 1 << 20;
+
+// Steps of a world of `cells` cells that fit in one slice, at least one
+inline uint64_t slice_steps(uint64_t cells)
+{
+    return std::max<uint64_t>(1, REPLICA_SLICE_CELLS / std::max<uint64_t>(cells, 1));
+}
+
+// One headless replica, run a slice of steps at a time. Its populations have one entry per step (steps + 1,
+// including the start); once every species is extinct the grid can no longer change, so the remaining steps are
+// left at zero.
+class replica_t
+{
+public:
+    replica_t(const ensemble_config_t &config, std::mt19937 gen)
+        : config(config), rules(config.rules), gen(gen), populations((size_t)config.steps + 1)
+    {
+        grid.reset(config.rows, config.cols);
+        populate_grid(grid, config.rules, config.plants, config.herbivores, config.carnivores, this->gen);
+        populations[0] = count_population(grid);
+    }
+
+    // Runs the next slice of steps, returns true once the replica is finished
+    bool run_slice()
+    {
+        uint64_t end = std::min<uint64_t>(step + slice_steps(grid.size()), config.steps);
+        for (; step < end && populations[step].total() > 0; step++)
+        {
+            simulate_step(grid, rules, gen);
+            populations[step + 1] = count_population(grid);
+        }
+        return step == config.steps || populations[step].total() == 0;
+    }
+
+    const std::vector<population_t> &result() const { return populations; }
+
+    grid_distributions_t distributions() const
+    {
+        grid_distributions_t distributions(config.rules);
+        distributions.add(grid);
+        return distributions;
+    }
+
+private:
+    const ensemble_config_t config;
+    const compiled_rules_t rules;
+    std::mt19937 gen;
+    grid_t grid;
+    std::vector<population_t> populations;
+    uint64_t step = 0; // Steps run so far
+};
+
+// BATCH_LANES replicas, `first` onwards, run at once on the batched engine a slice of steps at a time, each with
+// populations as replica_t keeps them. Initial placements use the same seeds as the scalar engine; the steps draw
+// from per-lane generators, so a replica's trajectory differs from its scalar run but follows the same rules.
+class replica_batch_t
+{
+public:
+    replica_batch_t(const ensemble_config_t &config, uint32_t seed, uint32_t first)
+        : config(config), rules(config.rules), populations(BATCH_LANES, std::vector<population_t>((size_t)config.steps + 1))
+    {
+        grid.reset(config.rows, config.cols);
+        for (uint32_t l = 0; l < BATCH_LANES; l++)
+        {
+            std::seed_seq seq{seed, first + l};
+            std::mt19937 gen(seq);
+            grid_t lane;
+            lane.reset(config.rows, config.cols);
+            populate_grid(lane, config.rules, config.plants, config.herbivores, config.carnivores, gen);
+            grid.load(l, lane);
+            std::seed_seq lane_seq{seed, first + l, BATCH_LANES};
+            rng.seed(l, lane_seq);
+        }
+        record();
+    }
+
+    // Runs the next slice of steps, returns true once every lane is finished
+    bool run_slice()
+    {
+        uint64_t end = std::min<uint64_t>(step + slice_steps((uint64_t)config.rows * config.cols * BATCH_LANES), config.steps);
+        while (step < end && alive)
+        {
+            batch_step(grid, rules, rng);
+            step++;
+            record();
+        }
+        return step == config.steps || !alive;
+    }
+
+    const std::vector<std::vector<population_t>> &result() const { return populations; }
+
+    // Distributions of the grids of all the lanes together
+    grid_distributions_t distributions() const
+    {
+        grid_distributions_t distributions(config.rules);
+        for (uint32_t i = 0; i < grid.rows; i++)
+            for (uint32_t j = 0; j < grid.cols; j++)
+            {
+                uint32_t c = grid.cell(i, j);
+                for (uint32_t l = 0; l < BATCH_LANES; l++)
+                    if (grid.type[c][l] != empty)
+                        distributions.add({(entity_type_t)grid.type[c][l], grid.energy[c][l], grid.age[c][l]});
+            }
+        return distributions;
+    }
+
+private:
+    // Counts the populations of the current step
+    void record()
+    {
+        population_t counts[BATCH_LANES];
+        grid.count(counts);
+        uint32_t total = 0;
+        for (uint32_t l = 0; l < BATCH_LANES; l++)
+        {
+            populations[l][step] = counts[l];
+            total += counts[l].total();
+        }
+        alive = total > 0;
+    }
+
+    const ensemble_config_t config;
+    const compiled_rules_t rules;
+    batch_grid_t grid;
+    batch_rng_t rng;
+    std::vector<std::vector<population_t>> populations;
+    uint64_t step = 0; // Steps run so far
+    bool alive = true; // Whether any lane has a living entity
+};
+
+// Whether an ensemble is better run on the batched engine: small worlds, with at least one full batch of replicas
+inline bool use_batch_engine(const ensemble_config_t &config, uint32_t replicas)
+{
+    return (uint64_t)config.rows * config.cols <= BATCH_MAXIMUM_CELLS && replicas >= BATCH_LANES;
+}
+
+// Population statistics across the replicas of an ensemble, one entry per step and species
+struct ensemble_stats_t
+{
+    std::vector<std::array<running_stats_t, 3>> steps;
+    uint32_t replicas = 0;
+    uint32_t extinct_replicas = 0;
+    uint32_t failed = 0;                 // Replicas that could not run, as when out of memory; not in the statistics
+    population_t extinctions;            // Replicas in which each species died out
+    grid_distributions_t distributions; // Of the final grids of the replicas, merged
+
+    explicit ensemble_stats_t(uint32_t steps = 0) : steps((size_t)steps + 1) {}
+
+    // Adds a replica's populations, and with `final` its final distributions (for a batch, those of all its lanes)
+    void add(const std::vector<population_t> &populations, const grid_distributions_t *final = nullptr)
+    {
+        if (final)
+            distributions.merge(*final);
+        for (size_t step = 0; step < steps.size(); step++)
+        {
+            steps[step][0].add(populations[step].plants);
+            steps[step][1].add(populations[step].herbivores);
+            steps[step][2].add(populations[step].carnivores);
+        }
+        const population_t &last = populations.back();
+        replicas++;
+        extinct_replicas += last.total() == 0;
+        extinctions.plants += last.plants == 0;
+        extinctions.herbivores += last.herbivores == 0;
+        extinctions.carnivores += last.carnivores == 0;
+    }
+};
+
+// Runs `replicas` independently seeded replicas on the scheduler's workers, in slices, and waits for their
+// statistics. Replica r is seeded with (seed, r), so any replica can be reproduced on its own on the same engine.
+inline ensemble_stats_t run_ensemble(scheduler_t &scheduler, const ensemble_config_t &config, uint32_t replicas, uint32_t seed, bool use_batch)
+{
+    struct state_t
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        ensemble_stats_t stats;
+
+        void fail(uint32_t replicas)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.failed += replicas;
+            done.notify_all();
+        }
+    };
+    auto state = std::make_shared<state_t>();
+    state->stats = ensemble_stats_t(config.steps);
+    state->stats.distributions = grid_distributions_t(config.rules);
+
+    // Full batches of replicas go to the batched engine, the rest run one by one. A task allocates its grid in its
+    // first slice, so only the replicas started hold memory.
+    uint32_t batched = use_batch ? replicas / BATCH_LANES * BATCH_LANES : 0;
+    for (uint32_t first = 0; first < batched; first += BATCH_LANES)
+        scheduler.submit_sliced([state, config, seed, first, batch = std::shared_ptr<replica_batch_t>()]() mutable
+                                {
+            if (!batch)
+                batch = std::make_shared<replica_batch_t>(config, seed, first);
+            if (!batch->run_slice())
+                return false;
+            grid_distributions_t distributions = batch->distributions();
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            for (auto &lane : batch->result())
+                state->stats.add(lane, &lane == &batch->result()[0] ? &distributions : nullptr);
+            state->done.notify_all();
+            return true; },
+                                [state]
+                                { state->fail(BATCH_LANES); });
+
+    for (uint32_t r = batched; r < replicas; r++)
+        scheduler.submit_sliced([state, config, seed, r, replica = std::shared_ptr<replica_t>()]() mutable
+                                {
+            if (!replica)
+            {
+                std::seed_seq seq{seed, r};
+                replica = std::make_shared<replica_t>(config, std::mt19937(seq));
+            }
+            if (!replica->run_slice())
+                return false;
+            grid_distributions_t distributions = replica->distributions();
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stats.add(replica->result(), &distributions);
+            state->done.notify_all();
+            return true; },
+                                [state]
+                                { state->fail(1); });
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&]
+                     { return state->stats.replicas + state->stats.failed == replicas; });
+    return std::move(state->stats);
+}
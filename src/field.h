@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Storage of one grid field: a heap array, or a window onto a shared memory-mapped file so that worlds larger
+// than RAM are paged in and out by the kernel. Copies always land on the heap.
+template <typename T>
+class field_t
+{
+public:
+    field_t() = default;
+    field_t(const field_t &other) : heap(other.begin(), other.end()), ptr(heap.data()), count(heap.size()) {}
+    field_t &operator=(const field_t &other)
+    {
+        if (this != &other)
+        {
+            heap.assign(other.begin(), other.end());
+            mapping.reset();
+            ptr = heap.data();
+            count = heap.size();
+        }
+        return *this;
+    }
+
+    // Resizes a heap field; a mapped field keeps its size, only its contents are overwritten
+    void assign(size_t size, T value)
+    {
+        if (mapping)
+            std::fill(begin(), end(), value);
+        else
+        {
+            heap.assign(size, value);
+            ptr = heap.data();
+            count = size;
+        }
+    }
+
+    // Maps `size` elements of the file `fd` from `offset`, which must be page aligned
+    bool map(int fd, size_t offset, size_t size)
+    {
+        void *data = mmap(nullptr, std::max<size_t>(size, 1) * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        if (data == MAP_FAILED)
+            return false;
+        size_t length = std::max<size_t>(size, 1) * sizeof(T);
+        mapping = std::shared_ptr<void>(data, [length](void *p)
+                                        { munmap(p, length); });
+        madvise(data, length, MADV_SEQUENTIAL);
+        heap = std::vector<T>();
+        ptr = (T *)data;
+        count = size;
+        return true;
+    }
+
+    bool mapped() const { return (bool)mapping; }
+
+    // Gives the kernel a paging hint for elements [first, first + size) of a mapped field
+    void advise(size_t first, size_t size, int advice) const
+    {
+        if (!mapping || first >= count || size == 0)
+            return;
+        size = std::min(size, count - first);
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)(ptr + first) & ~(page - 1);
+        uintptr_t end = (uintptr_t)(ptr + first + size);
+        madvise((void *)start, end - start, advice);
+    }
+
+    // Starts writing back the dirty pages of elements [first, first + size) without waiting for it
+    void flush(size_t first, size_t size) const
+    {
+        if (!mapping || first >= count || size == 0)
+            return;
+        size = std::min(size, count - first);
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)(ptr + first) & ~(page - 1);
+        uintptr_t end = (uintptr_t)(ptr + first + size);
+        msync((void *)start, end - start, MS_ASYNC);
+    }
+
+    T &operator[](size_t i) { return ptr[i]; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+    T *data() { return ptr; }
+    const T *data() const { return ptr; }
+    T *begin() { return ptr; }
+    T *end() { return ptr + count; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+    size_t size() const { return count; }
+
+private:
+    std::vector<T> heap;
+    std::shared_ptr<void> mapping;
+    T *ptr = nullptr;
+    size_t count = 0;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Series kept by a population history: the count of each species and the total energy of the entities
+static const uint32_t HISTORY_SERIES = 4;
+
+// Tiers of a population history: tier 0 keeps one bucket per step, each later tier buckets HISTORY_TIER_FACTOR
+// times more steps than the one before, and every tier keeps its last HISTORY_TIER_BUCKETS buckets, so about
+// 2 million steps are covered in fixed memory
+static const uint32_t HISTORY_TIERS = 4;
+static const uint32_t HISTORY_TIER_FACTOR = 16;
+static const uint32_t HISTORY_TIER_BUCKETS = 512;
+
+// Consecutive steps summarized as the minimum, maximum and sum of each series
+struct history_bucket_t
+{
+    uint64_t first = 0; // Step of the first sample
+    uint32_t steps = 0;
+    std::array<int64_t, HISTORY_SERIES> min{};
+    std::array<int64_t, HISTORY_SERIES> max{};
+    std::array<int64_t, HISTORY_SERIES> sum{};
+
+    uint64_t last() const { return first + steps - 1; }
+    double mean(uint32_t series) const { return (double)sum[series] / steps; }
+
+    void add(uint64_t step, const std::array<int64_t, HISTORY_SERIES> &sample)
+    {
+        if (steps == 0)
+        {
+            first = step;
+            min = max = sample;
+            sum = {};
+        }
+        for (uint32_t k = 0; k < HISTORY_SERIES; k++)
+        {
+            min[k] = std::min(min[k], sample[k]);
+            max[k] = std::max(max[k], sample[k]);
+            sum[k] += sample[k];
+        }
+        steps++;
+    }
+};
+
+// Population and energy of a session at every step, recent steps at full resolution and older ones downsampled
+class population_history_t
+{
+public:
+    // Records the stats of `step`. A sample for the step already recorded, as after an edit, is ignored; any other
+    // step but the next one starts the history over, as after a restore.
+    void add(uint64_t step, const grid_stats_t &stats)
+    {
+        if (recorded && step == last_step)
+            return;
+        if (recorded && step != last_step + 1)
+            clear();
+        std::array<int64_t, HISTORY_SERIES> sample = {(int64_t)stats.count[plant], (int64_t)stats.count[herbivore], (int64_t)stats.count[carnivore],
+                                                      stats.energy[plant] + stats.energy[herbivore] + stats.energy[carnivore]};
+        uint32_t span = 1;
+        for (tier_t &tier : tiers)
+        {
+            tier.open.add(step, sample);
+            if (tier.open.steps == span)
+            {
+                tier.push(tier.open);
+                tier.open = history_bucket_t();
+            }
+            span *= HISTORY_TIER_FACTOR;
+        }
+        recorded = true;
+        last_step = step;
+    }
+
+    void clear() { *this = population_history_t(); }
+
+    // Buckets overlapping steps [`from`, `to`], oldest first, each from the finest tier still holding its steps
+    std::vector<history_bucket_t> range(uint64_t from, uint64_t to) const
+    {
+        std::vector<history_bucket_t> buckets;
+        uint64_t covered = UINT64_MAX; // First step of the buckets taken so far
+        for (const tier_t &tier : tiers)
+        {
+            if (covered <= from)
+                break;
+            std::vector<history_bucket_t> older;
+            for (size_t k = 0; k < tier.ring.size(); k++)
+            {
+                const history_bucket_t &bucket = tier.at(k);
+                if (bucket.first < covered && bucket.last() >= from && bucket.first <= to)
+                    older.push_back(bucket);
+            }
+            if (older.empty())
+                continue;
+            // A coarse bucket straddling the finer ones replaces those it overlaps
+            uint64_t end = older.back().last();
+            buckets.erase(buckets.begin(), std::find_if(buckets.begin(), buckets.end(), [end](const history_bucket_t &b)
+                                                        { return b.first > end; }));
+            buckets.insert(buckets.begin(), older.begin(), older.end());
+            covered = older.front().first;
+        }
+        return buckets;
+    }
+
+private:
+    // Fixed-size ring of the tier's last buckets, plus the one still filling
+    struct tier_t
+    {
+        std::vector<history_bucket_t> ring;
+        size_t head = 0; // Oldest bucket, once the ring is full
+        history_bucket_t open;
+
+        void push(const history_bucket_t &bucket)
+        {
+            if (ring.size() < HISTORY_TIER_BUCKETS)
+            {
+                ring.push_back(bucket);
+                return;
+            }
+            ring[head] = bucket;
+            head = (head + 1) % HISTORY_TIER_BUCKETS;
+        }
+
+        // k-th bucket, oldest first
+        const history_bucket_t &at(size_t k) const { return ring[(head + k) % ring.size()]; }
+    };
+
+    std::array<tier_t, HISTORY_TIERS> tiers;
+    bool recorded = false;
+    uint64_t last_step = 0;
+};
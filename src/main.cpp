@@ -3,47 +3,19 @@
 
 #include "crow_all.h"
 #include "json.hpp"
-#include <random>
-
-static const uint32_t NUM_ROWS = 15;
-
-// Constants
-const uint32_t PLANT_MAXIMUM_AGE = 10;
-const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
-const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
-const uint32_t MAXIMUM_ENERGY = 200;
-const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
-
-// Probabilities
-const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
-const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
-const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
-const double HERBIVORE_MOVE_PROBABILITY = 0.7;
-const double HERBIVORE_EAT_PROBABILITY = 0.9;
-const double CARNIVORE_MOVE_PROBABILITY = 0.5;
-const double CARNIVORE_EAT_PROBABILITY = 1.0;
-
-// Type definitions
-enum entity_type_t
-{
-    empty,
-    plant,
-    herbivore,
-    carnivore
-};
+#include "checkpoint.h"
+#include "ensemble.h"
+#include "scheduler.h"
+#include "sweep.h"
+#include "wire.h"
 
-struct pos_t
-{
-    uint32_t i;
-    uint32_t j;
-};
-
-struct entity_t
-{
-    entity_type_t type;
-    int32_t energy;
-    int32_t age;
-};
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
 
 // Auxiliary code to convert the entity_type_t enum to a string
 NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
@@ -53,21 +25,952 @@ NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
                                                 {carnivore, "C"},
                                             })
 
-// Auxiliary code to convert the entity_t struct to a JSON object
+// Auxiliary code to convert the entity_t struct and the grid to JSON
 namespace nlohmann
 {
     void to_json(nlohmann::json &j, const entity_t &e)
     {
         j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
     }
+
+    void from_json(const nlohmann::json &j, entity_t &e)
+    {
+        e.type = j.at("type").get<entity_type_t>();
+        e.energy = j.value("energy", 0);
+        e.age = j.value("age", 0);
+    }
+
+    void to_json(nlohmann::json &j, const grid_t &grid)
+    {
+        j = nlohmann::json::array();
+        for (uint32_t i = 0; i < grid.rows; i++)
+        {
+            nlohmann::json row = nlohmann::json::array();
+            for (uint32_t j = 0; j < grid.cols; j++)
+                row.push_back(grid.at(grid.index(i, j)));
+            j.push_back(std::move(row));
+        }
+    }
+}
+
+static const char *DEFAULT_SESSION = "default";
+
+// Threads serving requests. Handlers wait while the scheduler runs their work (steps, ensembles, replays), so there
+// are enough of them that a long ensemble does not hold up the other requests.
+static const uint16_t HTTP_THREADS = 16;
+
+// Largest world kept on the heap, about 10 bytes per cell; larger ones must be memory-mapped
+static const uint64_t MAXIMUM_HEAP_CELLS = 8192 * 8192;
+
+// Running simulations, by session id
+static std::map<std::string, std::shared_ptr<session_t>> sessions;
+static std::mutex sessions_mutex;
+
+// Worker pool shared by the steps of every session
+static scheduler_t scheduler;
+
+static std::shared_ptr<session_t> find_session(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(id);
+    return it == sessions.end() ? nullptr : it->second;
+}
+
+// Makes `session` the one with its id and starts scheduling it, stopping any previous session with the same id.
+// It is scheduled within the same critical section, so a concurrent replacement always finds it scheduled and
+// stops it, instead of leaving it stepping unreachable.
+static void replace_session(const std::shared_ptr<session_t> &session, double rate, double weight)
+{
+    std::shared_ptr<session_t> previous;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        previous = sessions[session->id];
+        sessions[session->id] = session;
+        scheduler.add(session, rate, weight);
+    }
+    if (previous)
+        scheduler.remove(previous);
+}
+
+// Reads the unsigned integer URL parameter `name` into `value`, left as is when the parameter is absent; returns
+// false if it is not a number
+static bool url_number(const crow::request &req, const char *name, uint64_t &value)
+{
+    const char *text = req.url_params.get(name);
+    if (!text)
+        return true;
+    char *end;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (*text == '\0' || *text == '-' || *end != '\0' || errno == ERANGE)
+        return false;
+    value = parsed;
+    return true;
+}
+
+static std::string session_id(const crow::request &req)
+{
+    const char *id = req.url_params.get("session");
+    return id ? id : DEFAULT_SESSION;
+}
+
+// Encoding asked for by the request's Accept header
+static wire_format_t wire_format(const crow::request &req)
+{
+    return parse_accept(req.get_header_value("Accept"));
+}
+
+static crow::response binary_response(wire_format_t format, std::string body)
+{
+    crow::response res(std::move(body));
+    res.set_header("Content-Type", content_type(format));
+    return res;
+}
+
+// A body in `format`, labelled as such unless JSON
+static crow::response format_response(wire_format_t format, std::string body)
+{
+    return format == JSON_FORMAT ? crow::response(std::move(body)) : binary_response(format, std::move(body));
+}
+
+// A JSON body as MessagePack or CBOR if asked for; the packed layout only exists for grids, so other bodies stay JSON
+static std::string encoded_body(wire_format_t format, const nlohmann::json &body)
+{
+    std::vector<uint8_t> bytes;
+    if (format == MSGPACK_FORMAT)
+        nlohmann::json::to_msgpack(body, bytes);
+    else if (format == CBOR_FORMAT)
+        nlohmann::json::to_cbor(body, bytes);
+    else
+        return body.dump();
+    return std::string(bytes.begin(), bytes.end());
+}
+
+static crow::response encoded_response(wire_format_t format, const nlohmann::json &body)
+{
+    return format_response(format == PACKED_FORMAT ? JSON_FORMAT : format, encoded_body(format, body));
+}
+
+// Compression asked for by the request's Accept-Encoding header
+static content_encoding_t accept_encoding(const crow::request &req)
+{
+    return parse_accept_encoding(req.get_header_value("Accept-Encoding"));
+}
+
+// A grid body in `format`, already compressed with `encoding`
+static crow::response frame_response(wire_format_t format, content_encoding_t encoding, std::string body)
+{
+    crow::response res = format_response(format, std::move(body));
+    if (encoding != IDENTITY_ENCODING)
+        res.set_header("Content-Encoding", content_encoding_name(encoding));
+    res.set_header("Vary", "Accept-Encoding");
+    return res;
+}
+
+// Compresses a grid body made for this one request
+static crow::response compressed_response(wire_format_t format, content_encoding_t encoding, std::string body)
+{
+    return frame_response(format, encoding, encoding == IDENTITY_ENCODING ? std::move(body) : compress_body(body, encoding));
+}
+
+// Grids from this many cells have their JSON written by the workers as well, in bands of rows
+static const uint32_t PARALLEL_JSON_CELLS = 1 << 18;
+static const uint32_t PARALLEL_JSON_BANDS_PER_WORKER = 4;
+
+// Runs band(0) to band(bands - 1) on the workers and the calling thread. The caller claims bands too, so this
+// finishes even when every worker is busy stepping, or waiting for the session being serialized.
+static void run_bands(uint32_t bands, const std::function<void(uint32_t)> &band)
+{
+    struct progress_t
+    {
+        std::atomic<uint32_t> next{0};
+        std::atomic<uint32_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    // Workers starting after every band was claimed find nothing left to do and never touch `band`
+    auto progress = std::make_shared<progress_t>();
+    auto work = [progress, bands, &band]
+    {
+        for (uint32_t b; (b = progress->next++) < bands;)
+        {
+            band(b);
+            if (++progress->done == bands)
+            {
+                std::lock_guard<std::mutex> lock(progress->mutex);
+                progress->finished.notify_all();
+            }
+        }
+    };
+    for (uint32_t k = 1; k < std::min(bands, scheduler.size() + 1); k++)
+        scheduler.submit(work);
+    work();
+    std::unique_lock<std::mutex> lock(progress->mutex);
+    progress->finished.wait(lock, [&]
+                            { return progress->done == bands; });
+}
+
+// Appends the grid's JSON, then `after`, to `text`. Large grids are written in two parallel passes over bands of
+// rows: the first measures each band exactly, the second writes every band straight to its offset in `text`.
+static void append_json_grid(std::string &text, const grid_t &grid, std::string_view after = {})
+{
+    if (grid.size() < PARALLEL_JSON_CELLS)
+    {
+        char *start = json_scratch(json_grid_bytes(grid) + after.size());
+        char *p = write_json_grid(start, grid);
+        p += after.copy(p, after.size());
+        text.append(start, p);
+        return;
+    }
+
+    uint32_t bands = std::min(grid.rows, scheduler.size() * PARALLEL_JSON_BANDS_PER_WORKER);
+    auto band_rows = [&](uint32_t b, uint32_t &first, uint32_t &last)
+    {
+        first = (uint64_t)grid.rows * b / bands;
+        last = (uint64_t)grid.rows * (b + 1) / bands;
+    };
+    std::vector<size_t> offsets(bands + 1);
+    run_bands(bands, [&](uint32_t b)
+              {
+        uint32_t first, last;
+        band_rows(b, first, last);
+        offsets[b + 1] = json_rows_bytes(grid, first, last); });
+    offsets[0] = text.size() + 1;
+    for (uint32_t b = 0; b < bands; b++)
+        offsets[b + 1] += offsets[b];
+
+    text.resize(offsets[bands] + 1 + after.size());
+    text[offsets[0] - 1] = '[';
+    text[offsets[bands]] = ']';
+    after.copy(&text[offsets[bands] + 1], after.size());
+    run_bands(bands, [&](uint32_t b)
+              {
+        uint32_t first, last;
+        band_rows(b, first, last);
+        write_json_rows(&text[offsets[b]], grid, first, last); });
+}
+
+// Layout asked for by the request's `layout` parameter
+static grid_layout_t grid_layout(const crow::request &req)
+{
+    return parse_layout(req.url_params.get("layout"));
+}
+
+// Appends a frame of the grid, then `after`: the dense array of rows, or with the `occupied` cells of a sparse
+// frame, {"cells": [[index, type, age, energy], ...], "cols", "rows", "sparse": true, "step"}
+static void append_json_frame(std::string &text, const grid_t &grid, uint64_t step, const std::vector<uint32_t> *occupied, std::string_view after = {})
+{
+    if (!occupied)
+    {
+        append_json_grid(text, grid, after);
+        return;
+    }
+    char *start = json_scratch(4 * JSON_NUMBER_BYTES + 64 + json_sparse_bytes(occupied->size()) + after.size());
+    char *p = write_json_sparse(put_literal(start, "{\"cells\":"), grid, *occupied);
+    p = put_number(put_literal(p, ",\"cols\":"), grid.cols);
+    p = put_number(put_literal(p, ",\"rows\":"), grid.rows);
+    p = put_literal(put_number(put_literal(p, ",\"sparse\":true,\"step\":"), step), "}");
+    p += after.copy(p, after.size());
+    text.append(start, p);
+}
+
+// The same frame as a document, for MessagePack and CBOR
+static nlohmann::json frame_json(const grid_t &grid, uint64_t step, const std::vector<uint32_t> *occupied)
+{
+    if (!occupied)
+        return grid;
+    nlohmann::json cells = nlohmann::json::array();
+    for (uint32_t idx : *occupied)
+        cells.push_back({idx, grid.type[idx], grid.age[idx], grid.energy[idx]});
+    return {{"sparse", true}, {"rows", grid.rows}, {"cols", grid.cols}, {"step", step}, {"cells", std::move(cells)}};
+}
+
+static std::string grid_body(wire_format_t format, grid_layout_t layout, const grid_t &grid, uint64_t step)
+{
+    std::vector<uint32_t> occupied;
+    const std::vector<uint32_t> *sparse = sparse_frame(layout, grid, occupied) ? &occupied : nullptr;
+    std::string body;
+    if (format == JSON_FORMAT)
+        append_json_frame(body, grid, step, sparse);
+    else if (format == PACKED_FORMAT)
+        pack_frame(body, grid, step, sparse, sparse ? PACKED_SPARSE : 0);
+    else
+        body = encoded_body(format, frame_json(grid, step, sparse));
+    return body;
+}
+
+static crow::response grid_response(wire_format_t format, grid_layout_t layout, content_encoding_t encoding, const grid_t &grid, uint64_t step)
+{
+    return compressed_response(format, encoding, grid_body(format, layout, grid, step));
+}
+
+// Copies the window of the grid whose top left cell is (`row`, `col`) into `window`, already sized, a row slice at a
+// time, so that only the window's cells are read
+static void copy_region(const grid_t &grid, uint32_t row, uint32_t col, grid_t &window)
+{
+    for (uint32_t r = 0; r < window.rows; r++)
+    {
+        uint64_t from = (uint64_t)(row + r) * grid.cols + col, to = (uint64_t)r * window.cols;
+        std::copy_n(&grid.type[from], window.cols, &window.type[to]);
+        std::copy_n(&grid.energy[from], window.cols, &window.energy[to]);
+        std::copy_n(&grid.age[from], window.cols, &window.age[to]);
+    }
+    window.recount();
+}
+
+// A window of a grid at `step` whose top left cell is (`row`, `col`), as {"col", "grid": <frame>, "row", "step"};
+// packed, the window's frame alone
+static std::string region_body(wire_format_t format, grid_layout_t layout, const grid_t &window, uint32_t row, uint32_t col, uint64_t step)
+{
+    if (format == PACKED_FORMAT)
+        return grid_body(format, layout, window, step);
+    std::vector<uint32_t> occupied;
+    const std::vector<uint32_t> *sparse = sparse_frame(layout, window, occupied) ? &occupied : nullptr;
+    if (format == JSON_FORMAT)
+    {
+        std::string text = "{\"col\":" + std::to_string(col) + ",\"grid\":";
+        append_json_frame(text, window, step, sparse, ",\"row\":" + std::to_string(row) + ",\"step\":" + std::to_string(step) + "}");
+        return text;
+    }
+    return encoded_body(format, {{"row", row}, {"col", col}, {"step", step}, {"grid", frame_json(window, step, sparse)}});
+}
+
+// {"block", "rows", "cols", "step", "plants", "herbivores", "carnivores", "energy"}, the last four row-major by block,
+// energy being the mean energy of a block's entities
+static nlohmann::json density_json(const density_map_t &map, uint64_t step)
+{
+    std::vector<double> energy(map.energy.size());
+    for (size_t b = 0; b < energy.size(); b++)
+        energy[b] = map.mean_energy(b);
+    return {{"block", map.block}, {"rows", map.rows}, {"cols", map.cols}, {"step", step}, {"plants", map.plants},
+            {"herbivores", map.herbivores}, {"carnivores", map.carnivores}, {"energy", std::move(energy)}};
+}
+
+// {"step", "entities", "plants", "herbivores", "carnivores"}, each of the last four with the count, total and mean
+// energy and mean age of those entities
+static nlohmann::json stats_json(const grid_stats_t &stats, uint64_t step)
+{
+    auto totals_json = [](uint64_t count, int64_t energy, int64_t age)
+    {
+        return nlohmann::json{{"count", count}, {"energy", energy}, {"mean_energy", count ? (double)energy / count : 0},
+                              {"mean_age", count ? (double)age / count : 0}};
+    };
+    auto species_json = [&](entity_type_t type)
+    {
+        return totals_json(stats.count[type], stats.energy[type], stats.age[type]);
+    };
+    nlohmann::json body = {{"step", step}, {"plants", species_json(plant)}, {"herbivores", species_json(herbivore)}, {"carnivores", species_json(carnivore)}};
+    body["entities"] = totals_json(stats.count[plant] + stats.count[herbivore] + stats.count[carnivore],
+                                   stats.energy[plant] + stats.energy[herbivore] + stats.energy[carnivore],
+                                   stats.age[plant] + stats.age[herbivore] + stats.age[carnivore]);
+    return body;
+}
+
+// {"step": [...], "steps": [...], "plants": {"min": [...], "max": [...], "mean": [...]}, "herbivores", "carnivores",
+// "energy"}, a column per field of the buckets: their first step, number of steps and the summary of each series
+static nlohmann::json history_json(const std::vector<history_bucket_t> &buckets)
+{
+    static const char *SERIES[HISTORY_SERIES] = {"plants", "herbivores", "carnivores", "energy"};
+    nlohmann::json body = {{"step", nlohmann::json::array()}, {"steps", nlohmann::json::array()}};
+    for (const char *name : SERIES)
+        body[name] = {{"min", nlohmann::json::array()}, {"max", nlohmann::json::array()}, {"mean", nlohmann::json::array()}};
+    for (const history_bucket_t &bucket : buckets)
+    {
+        body["step"].push_back(bucket.first);
+        body["steps"].push_back(bucket.steps);
+        for (uint32_t k = 0; k < HISTORY_SERIES; k++)
+        {
+            nlohmann::json &series = body[SERIES[k]];
+            series["min"].push_back(bucket.min[k]);
+            series["max"].push_back(bucket.max[k]);
+            series["mean"].push_back(bucket.mean(k));
+        }
+    }
+    return body;
+}
+
+// {"count", "quantiles": {"p01", ..., "p99"}, "histogram": {"limit", "counts"}} of one distribution, the histogram's
+// bins splitting [0, limit] evenly
+// A histogram missing some of the values counted, after a failed merge, is left out
+static nlohmann::json distribution_json(const distribution_t &distribution)
+{
+    static const std::pair<const char *, double> QUANTILES[] = {{"p01", 0.01}, {"p05", 0.05}, {"p10", 0.1}, {"p25", 0.25}, {"p50", 0.5},
+                                                                {"p75", 0.75}, {"p90", 0.9}, {"p95", 0.95}, {"p99", 0.99}};
+    nlohmann::json quantiles;
+    for (auto &quantile : QUANTILES)
+        quantiles[quantile.first] = distribution.sketch.quantile(quantile.second);
+    nlohmann::json body = {{"count", distribution.sketch.size()}, {"quantiles", std::move(quantiles)}};
+    if (distribution.histogram_complete)
+        body["histogram"] = {{"limit", distribution.histogram.limit}, {"counts", distribution.histogram.counts}};
+    return body;
+}
+
+// {"plants": {"energy", "age"}, "herbivores", "carnivores"}
+static nlohmann::json distributions_json(const grid_distributions_t &distributions)
+{
+    auto species_json = [&](entity_type_t type)
+    {
+        return nlohmann::json{{"energy", distribution_json(distributions.energy[type])}, {"age", distribution_json(distributions.age[type])}};
+    };
+    return {{"plants", species_json(plant)}, {"herbivores", species_json(herbivore)}, {"carnivores", species_json(carnivore)}};
+}
+
+static nlohmann::json session_json(session_t &session)
+{
+    std::lock_guard<std::mutex> lock(session.mutex);
+    return {{"session", session.id}, {"rows", session.grid.rows}, {"cols", session.grid.cols}, {"step", session.step}, {"seed", session.recording.seed},
+            {"rate", session.rate.load()}, {"mapped", session.grid.mapped()}};
+}
+
+// The cells changed since the client's last seen step `since`, or the whole grid, in `layout`, if that is too far
+// back. A packed delta is a packed frame with the PACKED_DELTA flag, a full one a plain or sparse packed frame.
+// session.mutex must be held.
+static std::string delta_body(wire_format_t format, grid_layout_t layout, session_t &session, uint64_t since)
+{
+    std::vector<uint32_t> changed;
+    bool delta = session.changed_since(since, changed);
+    if (format == PACKED_FORMAT)
+    {
+        if (!delta)
+            return grid_body(format, layout, session.grid, session.step);
+        std::string body;
+        pack_frame(body, session.grid, session.step, &changed, PACKED_DELTA);
+        return body;
+    }
+    if (format == JSON_FORMAT)
+    {
+        const grid_t &grid = session.grid;
+        if (!delta)
+        {
+            std::vector<uint32_t> occupied;
+            std::string text = "{\"full\":true,\"grid\":";
+            append_json_frame(text, grid, session.step, sparse_frame(layout, grid, occupied) ? &occupied : nullptr,
+                              ",\"step\":" + std::to_string(session.step) + "}");
+            return text;
+        }
+        char *start = json_scratch(2 * JSON_NUMBER_BYTES + 64 + json_cells_bytes(changed.size()));
+        char *p = write_json_cells(put_literal(start, "{\"cells\":"), grid, changed);
+        p = put_number(put_literal(p, ",\"full\":false,\"since\":"), since);
+        p = put_literal(put_number(put_literal(p, ",\"step\":"), session.step), "}");
+        return std::string(start, p);
+    }
+    if (!delta)
+    {
+        std::vector<uint32_t> occupied;
+        bool sparse = sparse_frame(layout, session.grid, occupied);
+        return encoded_body(format, {{"step", session.step}, {"full", true}, {"grid", frame_json(session.grid, session.step, sparse ? &occupied : nullptr)}});
+    }
+
+    nlohmann::json cells = nlohmann::json::array();
+    for (uint32_t idx : changed)
+    {
+        nlohmann::json cell = session.grid.at(idx);
+        cell["row"] = idx / session.grid.cols;
+        cell["col"] = idx % session.grid.cols;
+        cells.push_back(std::move(cell));
+    }
+    return encoded_body(format, {{"step", session.step}, {"since", since}, {"full", false}, {"cells", std::move(cells)}});
+}
+
+// Drops the frames cached for earlier revisions of the session. session.mutex must be held.
+static void expire_frames(session_t &session)
+{
+    if (session.frames_revision != session.revision)
+    {
+        session.frames.clear();
+        session.frames_hash = 0;
+        session.distributions.reset();
+        session.frames_revision = session.revision;
+    }
+}
+
+// Frames a session caches per revision; once it has that many, further ones are only encoded for their request
+static const size_t MAXIMUM_CACHED_FRAMES = 64;
+
+// Cached frame of the session for `key`, null if there is none. session.mutex must be held.
+static std::shared_ptr<const std::string> cached_frame(session_t &session, const session_t::frame_key_t &key)
+{
+    expire_frames(session);
+    auto it = session.frames.find(key);
+    return it == session.frames.end() ? nullptr : it->second;
+}
+
+// Caches `frame` for `key` if there is room, and returns the frame cached for `key`, the first one cached winning.
+// session.mutex must be held.
+static std::shared_ptr<const std::string> cache_frame(session_t &session, const session_t::frame_key_t &key, std::shared_ptr<const std::string> frame)
+{
+    expire_frames(session);
+    auto it = session.frames.find(key);
+    if (it != session.frames.end())
+        return it->second;
+    if (session.frames.size() < MAXIMUM_CACHED_FRAMES)
+        session.frames.emplace(key, frame);
+    return frame;
+}
+
+// Fingerprint of the session's grid, computed once per revision. session.mutex must be held.
+static uint64_t state_hash(session_t &session)
+{
+    expire_frames(session);
+    if (session.frames_hash == 0)
+    {
+        const grid_t &grid = session.grid;
+        std::hash<std::string_view> hash;
+        uint64_t h = hash(std::string_view((const char *)grid.type.data(), grid.size() * sizeof(grid.type[0])));
+        h = h * 0x9E3779B97F4A7C15ull ^ hash(std::string_view((const char *)grid.energy.data(), grid.size() * sizeof(grid.energy[0])));
+        h = h * 0x9E3779B97F4A7C15ull ^ hash(std::string_view((const char *)grid.age.data(), grid.size() * sizeof(grid.age[0])));
+        session.frames_hash = std::max<uint64_t>(h, 1);
+    }
+    return session.frames_hash;
+}
+
+// A frame of the session, the grid or with `delta` the cells changed since `since`. It is encoded once per revision
+// of the session and compressed once per encoding, and the same buffer goes to every stream subscriber and poller
+// asking for it, so the cost of a frame does not grow with the number of viewers. `step` and `hash`, if given, get
+// the step and the state hash of the frame.
+static std::shared_ptr<const std::string> shared_frame(wire_format_t format, grid_layout_t layout, content_encoding_t encoding, session_t &session,
+                                                       bool delta, uint64_t since, uint64_t *step = nullptr, uint64_t *hash = nullptr)
+{
+    session_t::frame_key_t key;
+    std::shared_ptr<const std::string> identity;
+    uint64_t revision;
+    {
+        std::lock_guard<std::mutex> lock(session.mutex);
+        if (step)
+            *step = session.step;
+        if (hash)
+            *hash = state_hash(session);
+        // Every step the history does not reach back to gets the same whole grid, under one key
+        uint64_t since_key = !delta ? 0 : session.history_covers(since) ? since : UINT64_MAX;
+        key = {format, layout, encoding, delta, since_key};
+        if (auto frame = cached_frame(session, key))
+            return frame;
+        session_t::frame_key_t identity_key{format, layout, IDENTITY_ENCODING, delta, since_key};
+        identity = cached_frame(session, identity_key);
+        if (!identity)
+            identity = cache_frame(session, identity_key, std::make_shared<const std::string>(delta ? delta_body(format, layout, session, since) : grid_body(format, layout, session.grid, session.step)));
+        if (encoding == IDENTITY_ENCODING)
+            return identity;
+        revision = session.revision;
+    }
+
+    // Compressing takes longer than encoding, so it is done without holding up the session's steps; clients racing
+    // for the same frame may each compress it, and the first copy cached wins
+    auto compressed = std::make_shared<const std::string>(compress_body(*identity, encoding));
+    std::lock_guard<std::mutex> lock(session.mutex);
+    if (session.revision != revision)
+        return compressed;
+    return cache_frame(session, key, std::move(compressed));
+}
+
+static crow::response session_grid_response(wire_format_t format, grid_layout_t layout, content_encoding_t encoding, session_t &session)
+{
+    return frame_response(format, encoding, *shared_frame(format, layout, encoding, session, false, 0));
+}
+
+static crow::response delta_response(wire_format_t format, grid_layout_t layout, content_encoding_t encoding, session_t &session, uint64_t since)
+{
+    return frame_response(format, encoding, *shared_frame(format, layout, encoding, session, true, since));
+}
+
+// The grid, or only the session summary for mapped worlds, which are too large to send whole
+static crow::response session_response(wire_format_t format, grid_layout_t layout, content_encoding_t encoding, session_t &session)
+{
+    return session.grid.mapped() ? encoded_response(format, session_json(session)) : session_grid_response(format, layout, encoding, session);
+}
+
+// Strong validator of a session's grid: its step and state hash, then the format, layout and compression, as each
+// is a different body for the same state
+static std::string state_etag(uint64_t step, uint64_t hash, wire_format_t format, grid_layout_t layout, content_encoding_t encoding)
+{
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llu-%016llx-%d%d%d\"", (unsigned long long)step, (unsigned long long)hash, format, layout, encoding);
+    return etag;
+}
+
+// Whether an If-None-Match header lists `etag`
+static bool etag_matches(const std::string &if_none_match, const std::string &etag)
+{
+    return if_none_match == "*" || if_none_match.find(etag) != std::string::npos;
+}
+
+// Whether each of `keys` is in `body` as an integer that fits in 32 bits
+static bool has_counts(const nlohmann::json &body, std::initializer_list<const char *> keys)
+{
+    return body.is_object() && std::all_of(keys.begin(), keys.end(), [&body](const char *key)
+                                           { return body.contains(key) && body[key].is_number_unsigned() && body[key].get<uint64_t>() <= UINT32_MAX; });
+}
+
+// Reads the optional non-negative number `key` of a request, as a rate or weight, leaving `value` as is when absent.
+// Returns false when it is not a finite number of at least 0, as a rate of 1 / 0 serialised to null.
+static bool optional_number(const nlohmann::json &body, const char *key, double &value)
+{
+    if (!body.contains(key))
+        return true;
+    const nlohmann::json &number = body[key];
+    if (!number.is_number() || !std::isfinite(number.get<double>()) || number.get<double>() < 0)
+        return false;
+    value = number.get<double>();
+    return true;
+}
+
+// Reads the optional "rules" object of a request, keyed by parameter name; returns false on an unknown parameter
+static bool parse_rules(const nlohmann::json &request_body, rule_set_t &rules)
+{
+    if (!request_body.contains("rules"))
+        return true;
+    if (!request_body["rules"].is_object())
+        return false;
+    for (auto &rule : request_body["rules"].items())
+    {
+        const rule_parameter_t *parameter = find_rule_parameter(rule.key());
+        if (!parameter || !rule.value().is_number())
+            return false;
+        set_rule_parameter(rules, *parameter, rule.value().get<double>());
+    }
+    return true;
+}
+
+static nlohmann::json rule_parameter_json(const rule_set_t &rules, const rule_parameter_t &parameter)
+{
+    if (parameter.integer)
+        return rules.*parameter.integer;
+    return rules.*parameter.probability;
+}
+
+static nlohmann::json rules_json(const rule_set_t &rules)
+{
+    nlohmann::json body = nlohmann::json::object();
+    for (auto &parameter : RULE_PARAMETERS)
+        body[parameter.name] = rule_parameter_json(rules, parameter);
+    return body;
+}
+
+// Reads an edit, with "cells" to overwrite and "rules" to change; returns false if a cell is outside the grid
+static bool parse_edit(const nlohmann::json &body, uint32_t rows, uint32_t cols, session_edit_t &edit)
+{
+    edit.step = body.value("step", (uint64_t)0);
+    for (auto &cell : body.value("cells", nlohmann::json::array()))
+    {
+        if (!has_counts(cell, {"row", "col"}) || !cell.contains("type"))
+            return false;
+        cell_edit_t cell_edit{cell["row"], cell["col"], cell.get<entity_t>()};
+        if (cell_edit.row >= rows || cell_edit.col >= cols)
+            return false;
+        edit.cells.push_back(cell_edit);
+    }
+    nlohmann::json rules = body.value("rules", nlohmann::json::object());
+    for (auto &rule : rules.items())
+    {
+        const rule_parameter_t *parameter = find_rule_parameter(rule.key());
+        if (!parameter || !rule.value().is_number())
+            return false;
+        edit.rules.emplace_back(parameter, rule.value().get<double>());
+    }
+    return true;
+}
+
+static nlohmann::json edit_json(const session_edit_t &edit)
+{
+    nlohmann::json cells = nlohmann::json::array();
+    for (auto &cell : edit.cells)
+    {
+        nlohmann::json cell_json = cell.entity;
+        cell_json["row"] = cell.row;
+        cell_json["col"] = cell.col;
+        cells.push_back(std::move(cell_json));
+    }
+    nlohmann::json rules = nlohmann::json::object();
+    for (auto &parameter : edit.rules)
+        rules[parameter.first->name] = parameter.second;
+    return {{"step", edit.step}, {"cells", std::move(cells)}, {"rules", std::move(rules)}};
+}
+
+static nlohmann::json recording_json(const recording_t &recording)
+{
+    nlohmann::json edits = nlohmann::json::array();
+    for (auto &edit : recording.edits)
+        edits.push_back(edit_json(edit));
+    return {{"rows", recording.rows}, {"cols", recording.cols}, {"plants", recording.plants}, {"herbivores", recording.herbivores},
+            {"carnivores", recording.carnivores}, {"seed", recording.seed}, {"rules", rules_json(recording.rules)}, {"edits", std::move(edits)}};
+}
+
+// Reads the start parameters of a session, or a whole recording; returns false if they are invalid
+static bool parse_recording(const nlohmann::json &body, recording_t &recording)
+{
+    if (!has_counts(body, {"plants", "herbivores", "carnivores"}) || !parse_rules(body, recording.rules))
+        return false;
+    for (const char *key : {"rows", "cols", "seed"})
+        if (body.contains(key) && !has_counts(body, {key}))
+            return false;
+    recording.rows = body.value("rows", NUM_ROWS);
+    recording.cols = body.value("cols", NUM_ROWS);
+    recording.plants = body.at("plants");
+    recording.herbivores = body.at("herbivores");
+    recording.carnivores = body.at("carnivores");
+    recording.seed = body.value("seed", std::random_device{}());
+    for (auto &edit : body.value("edits", nlohmann::json::array()))
+    {
+        recording.edits.emplace_back();
+        if (!parse_edit(edit, recording.rows, recording.cols, recording.edits.back()))
+            return false;
+        if (recording.edits.size() > 1 && recording.edits.back().step < recording.edits[recording.edits.size() - 2].step)
+            return false;
+    }
+    return true;
+}
+
+// Limits of one ensemble, sweep or replay request: the statistics keep about 1.3 KB per step, and each worker holds a
+// whole replica's grid
+static const uint32_t MAXIMUM_ENSEMBLE_STEPS = 10000;
+static const uint32_t MAXIMUM_ENSEMBLE_REPLICAS = 10000;
+static const uint64_t MAXIMUM_ENSEMBLE_CELLS = 4096 * 4096;
+
+// Reads the initial conditions shared by ensemble and sweep requests, returns false if they are invalid
+static bool parse_ensemble_config(const nlohmann::json &request_body, ensemble_config_t &config)
+{
+    if (!has_counts(request_body, {"plants", "herbivores", "carnivores", "steps"}) || !parse_rules(request_body, config.rules))
+        return false;
+    config.rows = request_body.value("rows", NUM_ROWS);
+    config.cols = request_body.value("cols", NUM_ROWS);
+    config.plants = request_body.at("plants");
+    config.herbivores = request_body.at("herbivores");
+    config.carnivores = request_body.at("carnivores");
+    config.steps = request_body.at("steps");
+    return config.rows > 0 && config.cols > 0 && (uint64_t)config.rows * config.cols <= MAXIMUM_ENSEMBLE_CELLS && config.steps <= MAXIMUM_ENSEMBLE_STEPS &&
+           (uint64_t)config.plants + config.herbivores + config.carnivores <= (uint64_t)config.rows * config.cols;
+}
+
+static nlohmann::json population_stats_json(const std::array<running_stats_t, 3> &species)
+{
+    auto stats_json = [](const running_stats_t &s)
+    {
+        return nlohmann::json{{"mean", s.mean}, {"variance", s.variance()}, {"p05", s.p05.value()}, {"p50", s.p50.value()}, {"p95", s.p95.value()}};
+    };
+    return {{"plants", stats_json(species[0])}, {"herbivores", stats_json(species[1])}, {"carnivores", stats_json(species[2])}};
+}
+
+static nlohmann::json extinction_json(const ensemble_stats_t &stats)
+{
+    double replicas = std::max(stats.replicas, 1u);
+    return {{"plants", stats.extinctions.plants / replicas}, {"herbivores", stats.extinctions.herbivores / replicas}, {"carnivores", stats.extinctions.carnivores / replicas}};
+}
+
+// Scratch files backing mapped grids are created in this directory
+static const char *MAPPED_GRID_DIRECTORY = "grids";
+
+// Checkpoints are kept in this directory, one file per session
+static const char *CHECKPOINT_DIRECTORY = "checkpoints";
+
+// Trajectories are recorded in this directory, one .traj and one .tidx file per session
+static const char *TRAJECTORY_DIRECTORY = "trajectories";
+
+// Path of a file named after a session, or an empty string if the id cannot be used as a file name
+static std::string session_file(const char *directory, const std::string &id, const char *extension)
+{
+    if (id.empty() || id.size() > 128 || !std::all_of(id.begin(), id.end(), [](char c)
+                                                       { return std::isalnum((unsigned char)c) || c == '-' || c == '_'; }))
+        return "";
+    return std::string(directory) + "/" + id + extension;
 }
 
-// Grid that contains the entities
-static std::vector<std::vector<entity_t>> entity_grid;
+static std::string checkpoint_path(const std::string &id) { return session_file(CHECKPOINT_DIRECTORY, id, ".ckpt"); }
+
+// Identity of the files of a trajectory: the inodes of the .traj and .tidx files, and the modification time and
+// size of the index, which grows with every frame recorded
+using trajectory_files_t = std::tuple<ino_t, ino_t, int64_t, off_t>;
+
+// Open recorded trajectories, by name, with the files they were opened from
+static std::map<std::string, std::pair<trajectory_files_t, std::shared_ptr<trajectory_reader_t>>> trajectory_readers;
+static std::mutex trajectory_readers_mutex;
+
+// Maximum number of cells returned by one region request
+static const uint64_t MAXIMUM_REGION_CELLS = 1 << 22;
+
+// Block size of a density map when the request does not give one
+static const uint32_t DEFAULT_DENSITY_BLOCK = 16;
+
+// Maximum number of frames returned by one range request
+static const uint32_t MAXIMUM_RANGE_FRAMES = 1000;
+
+// The reader of a recorded trajectory, reopened when its index has grown or it was recorded again; nullptr if there
+// is no valid one
+static std::shared_ptr<trajectory_reader_t> open_trajectory(const std::string &name)
+{
+    std::string path = session_file(TRAJECTORY_DIRECTORY, name, "");
+    if (path.empty())
+        return nullptr;
+    struct stat data_status, index_status;
+    if (::stat((path + ".traj").c_str(), &data_status) != 0 || ::stat((path + ".tidx").c_str(), &index_status) != 0)
+        return nullptr;
+    trajectory_files_t files{data_status.st_ino, index_status.st_ino,
+                             (int64_t)index_status.st_mtim.tv_sec * 1000000000 + index_status.st_mtim.tv_nsec, index_status.st_size};
+
+    std::lock_guard<std::mutex> lock(trajectory_readers_mutex);
+    auto &entry = trajectory_readers[name];
+    if (!entry.second || entry.first != files)
+    {
+        auto reader = std::make_shared<trajectory_reader_t>();
+        entry = {files, reader->open(path) ? reader : nullptr};
+    }
+    return entry.second;
+}
+
+// Parameter sweep jobs, by id
+static std::map<std::string, std::shared_ptr<sweep_t>> sweeps;
+static std::mutex sweeps_mutex;
+static uint64_t next_sweep_id = 1;
+
+static const uint32_t MAXIMUM_SWEEP_RUNS = 1000000;
+// Each configuration keeps a summary of about 2.6 KB, so this bounds a sweep's memory to some 26 MB
+static const uint32_t MAXIMUM_SWEEP_CONFIGURATIONS = 10000;
+// Finished sweeps are dropped this long after their last configuration, and at most this many are kept at once
+static const steady_clock_t::duration SWEEP_RETENTION = std::chrono::minutes(10);
+static const size_t MAXIMUM_SWEEPS = 64;
+
+// Step of a stream subscriber that has not been sent a frame yet
+static const uint64_t NO_STEP = UINT64_MAX;
+
+// A client of the frame stream, following one session
+struct subscriber_t
+{
+    std::string session;
+    wire_format_t format = JSON_FORMAT;
+    grid_layout_t layout = DENSE_LAYOUT;
+    std::weak_ptr<session_t> source; // Session the last frame came from, as the id may have been restarted since
+    uint64_t step = NO_STEP;         // Of the last frame sent
+    bool behind = false;             // Missed a frame while its queue was full, and is sent one once it drains
+};
+
+// Frame stream subscribers, by connection; a connection is only used with the lock held, as it is removed
+// from here before Crow deletes it
+static std::map<crow::websocket::connection *, subscriber_t> subscribers;
+static std::mutex subscribers_mutex;
+
+// A subscriber's next frame, taken under subscribers_mutex and encoded outside it, so that encoding the frames of
+// a large world does not hold up the subscribers of every other session
+struct stream_frame_t
+{
+    crow::websocket::connection *connection;
+    wire_format_t format;
+    grid_layout_t layout;
+    uint64_t since; // Step of the last frame the subscriber got from the session, NO_STEP for none
+    uint64_t step = NO_STEP;
+    std::shared_ptr<const std::string> body;
+};
+
+// What the subscriber's next frame of the session is made from; subscribers_mutex must be held
+static stream_frame_t next_frame(crow::websocket::connection *connection, const subscriber_t &subscriber, const std::shared_ptr<session_t> &session)
+{
+    return {connection, subscriber.format, subscriber.layout, subscriber.source.lock() == session ? subscriber.step : NO_STEP};
+}
+
+// Encodes the session's current frame: the cells changed since the subscriber's last frame, or the whole grid.
+// Mapped worlds keep no dirty history and are too large to send whole, so their subscribers get the session
+// summary instead.
+static void encode_frame(stream_frame_t &frame, session_t &session)
+{
+    if (session.grid.mapped())
+        frame.body = std::make_shared<const std::string>(encoded_body(frame.format == PACKED_FORMAT ? JSON_FORMAT : frame.format, session_json(session)));
+    else
+        frame.body = shared_frame(frame.format, frame.layout, IDENTITY_ENCODING, session, true, frame.since, &frame.step);
+}
+
+// Sends encoded frames to the subscribers that still follow the session as they were when the frames were taken;
+// one sent another frame meanwhile gets the next one instead
+static void deliver_frames(std::vector<stream_frame_t> &frames, const std::shared_ptr<session_t> &session)
+{
+    std::lock_guard<std::mutex> lock(subscribers_mutex);
+    for (auto &frame : frames)
+    {
+        auto it = subscribers.find(frame.connection);
+        if (it == subscribers.end())
+            continue;
+        subscriber_t &subscriber = it->second;
+        if (subscriber.session != session->id || subscriber.format != frame.format || subscriber.layout != frame.layout ||
+            next_frame(frame.connection, subscriber, session).since != frame.since)
+            continue;
+        subscriber.behind = false;
+        subscriber.source = session;
+        subscriber.step = frame.step;
+        bool binary = frame.format == MSGPACK_FORMAT || frame.format == CBOR_FORMAT || (frame.format == PACKED_FORMAT && !session->grid.mapped());
+        frame.connection->send_shared(std::move(frame.body), binary);
+    }
+}
+
+// Sends the session's current frame to one subscriber, as it is after subscribing or catching up
+static void send_frame(crow::websocket::connection &connection, const std::shared_ptr<session_t> &session)
+{
+    std::vector<stream_frame_t> frames;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        auto it = subscribers.find(&connection);
+        if (it == subscribers.end())
+            return;
+        frames.push_back(next_frame(&connection, it->second, session));
+    }
+    encode_frame(frames[0], *session);
+    deliver_frames(frames, session);
+}
+
+// Bytes a stream subscriber may have waiting to be sent before it stops getting frames. Until its queue drains
+// the frames of the steps it misses are dropped; the next one it gets, at the next step or as soon as the queue
+// drains, covers them, holding the cells changed since its last frame, or the whole grid once it is further behind
+// than the dirty history goes.
+static const size_t MAXIMUM_QUEUED_BYTES = 4 << 20;
+
+// Sends a subscriber that missed frames the current one once its queue has drained, so that it is not left on a
+// stale frame when the session stops stepping. Runs on the connection's thread, which keeps it alive meanwhile.
+static void catch_up(crow::websocket::connection &connection)
+{
+    std::shared_ptr<session_t> session;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        auto it = subscribers.find(&connection);
+        if (it == subscribers.end() || !it->second.behind)
+            return;
+        session = find_session(it->second.session);
+    }
+    if (session)
+        send_frame(connection, session);
+}
+
+// Pushes a session's new frame to its subscribers, after each of its steps
+static void publish(session_t &session)
+{
+    auto current = find_session(session.id);
+    if (current.get() != &session)
+        return;
+    std::vector<stream_frame_t> frames;
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        for (auto &subscriber : subscribers)
+        {
+            if (subscriber.second.session != session.id)
+                continue;
+            crow::websocket::connection *connection = subscriber.first;
+            if (connection->queued_bytes() < MAXIMUM_QUEUED_BYTES)
+                frames.push_back(next_frame(connection, subscriber.second, current));
+            else if (!subscriber.second.behind)
+            {
+                subscriber.second.behind = true;
+                connection->when_drained([connection]
+                                         { catch_up(*connection); });
+            }
+        }
+    }
+    if (frames.empty())
+        return;
+    // Subscribers with the same format, layout and last step share one encoded frame, through the session's cache
+    for (auto &frame : frames)
+        encode_frame(frame, session);
+    deliver_frames(frames, current);
+}
 
 int main()
 {
     crow::SimpleApp app;
+    scheduler.on_step(publish);
 
     // Endpoint to serve the HTML page
     CROW_ROUTE(app, "/")
@@ -82,41 +985,793 @@ int main()
                                 { 
         // Parse the JSON request body
         nlohmann::json request_body = nlohmann::json::parse(req.body);
+        // A recording to replay brings its own start parameters and edits
+        bool replay = request_body.contains("replay");
+        const nlohmann::json &start = replay ? request_body["replay"] : request_body;
+        if (!has_counts(start, {"plants", "herbivores", "carnivores"})) {
+        res.code = 400;
+        res.body = replay ? "Invalid recording" : "Missing or invalid entity counts";
+        res.end();
+        return;
+        }
+        double rate = 0, weight = 1;
+        if (!optional_number(request_body, "rate", rate) || !optional_number(request_body, "weight", weight)) {
+        res.code = 400;
+        res.body = "Invalid rate or weight";
+        res.end();
+        return;
+        }
+        if ((start.contains("rows") && !has_counts(start, {"rows"})) || (start.contains("cols") && !has_counts(start, {"cols"}))) {
+        res.code = 400;
+        res.body = "Invalid grid size";
+        res.end();
+        return;
+        }
+        uint32_t rows = start.value("rows", NUM_ROWS);
+        uint32_t cols = start.value("cols", NUM_ROWS);
+        if (rows == 0 || cols == 0 || (uint64_t)rows * cols >= NO_CELL) {
+        res.code = 400;
+        res.body = "Invalid grid size";
+        res.end();
+        return;
+        }
+        bool mapped = request_body.value("mapped", false);
+        if (!mapped && (uint64_t)rows * cols > MAXIMUM_HEAP_CELLS) {
+        res.code = 400;
+        res.body = "Grid too large for memory, start it with \"mapped\": true";
+        res.end();
+        return;
+        }
 
        // Validate the request body 
-        uint32_t total_entinties = (uint32_t)request_body["plants"] + (uint32_t)request_body["herbivores"] + (uint32_t)request_body["carnivores"];
-        if (total_entinties > NUM_ROWS * NUM_ROWS) {
+        uint64_t total_entinties = start.at("plants").get<uint64_t>() + start.at("herbivores").get<uint64_t>() + start.at("carnivores").get<uint64_t>();
+        if (total_entinties > (uint64_t)rows * cols) {
         res.code = 400;
         res.body = "Too many entities";
         res.end();
         return;
         }
 
-        // Clear the entity grid
-        entity_grid.clear();
-        entity_grid.assign(NUM_ROWS, std::vector<entity_t>(NUM_ROWS, { empty, 0, 0}));
-        
-        // Create the entities
-        // <YOUR CODE HERE>
+        recording_t recording;
+        if (!parse_recording(start, recording)) {
+        res.code = 400;
+        res.body = replay ? "Invalid recording" : "Invalid rules";
+        res.end();
+        return;
+        }
+
+        // Create the entities in a fresh session, replacing any previous one with the same id
+        auto session = std::make_shared<session_t>();
+        session->id = request_body.value("session", DEFAULT_SESSION);
+        if (mapped) {
+        // Worlds larger than RAM live in a memory-mapped scratch file instead of the heap
+        std::error_code error;
+        std::filesystem::create_directories(MAPPED_GRID_DIRECTORY, error);
+        if (!session->grid.map_file(MAPPED_GRID_DIRECTORY, rows, cols)) {
+        res.code = 500;
+        res.body = "Could not map grid";
+        res.end();
+        return;
+        }
+        }
+        session->start(recording, replay);
 
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        res.body = json_grid.dump();
+        // Return the entity grid before the session starts running
+        res = session_response(wire_format(req), grid_layout(req), accept_encoding(req), *session);
+        replace_session(session, rate, weight);
         res.end(); });
 
     // Endpoint to process HTTP GET requests for the next simulation iteration
     CROW_ROUTE(app, "/next-iteration")
+        .methods("GET"_method)([](const crow::request &req)
+                               {
+        auto session = find_session(session_id(req));
+        if (!session)
+            return crow::response(404, "Simulation not started");
+
+        // Sessions with a rate target step on their own, the others step once per request
+        if (session->rate == 0)
+            scheduler.request_step(*session).wait();
+
+        // Clients that give their last seen step only get the cells changed since; mapped worlds keep no history,
+        // and get the summary as without it
+        uint64_t since = NO_STEP;
+        if (!url_number(req, "since", since))
+            return crow::response(400, "Invalid since");
+        if (since != NO_STEP && !session->grid.mapped())
+            return delta_response(wire_format(req), grid_layout(req), accept_encoding(req), *session, since);
+
+        // Return the entity grid, in JSON unless the client asked for a binary encoding
+        return session_response(wire_format(req), grid_layout(req), accept_encoding(req), *session); });
+
+    CROW_ROUTE(app, "/sessions")
         .methods("GET"_method)([]()
                                {
-        // Simulate the next iteration
-        // Iterate over the entity grid and simulate the behaviour of each entity
-        
-        // <YOUR CODE HERE>
-        
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        return json_grid.dump(); });
-    app.port(8080).run();
+        nlohmann::json body = nlohmann::json::array();
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        for (auto &entry : sessions)
+            body.push_back(session_json(*entry.second));
+        return body.dump(); });
+
+    CROW_ROUTE(app, "/sessions/<string>")
+        .methods("DELETE"_method)([](const std::string &id)
+                                  {
+        std::shared_ptr<session_t> session;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            auto it = sessions.find(id);
+            if (it == sessions.end())
+                return crow::response(404);
+            session = it->second;
+            sessions.erase(it);
+        }
+        scheduler.remove(session);
+        return crow::response(204); });
+
+    // The session's current grid without advancing it, for viewers and caches: it carries a strong ETag, and a
+    // client sending it back in If-None-Match gets a 304 until the grid changes. With `step`, only that step is served.
+    CROW_ROUTE(app, "/sessions/<string>/state")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        wire_format_t format = wire_format(req);
+        grid_layout_t layout = grid_layout(req);
+        content_encoding_t encoding = accept_encoding(req);
+        uint64_t wanted = NO_STEP;
+        if (!url_number(req, "step", wanted))
+            return crow::response(400, "Invalid step");
+        if (session->grid.mapped())
+            return encoded_response(format, session_json(*session));
+
+        uint64_t step, hash;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            step = session->step;
+            hash = state_hash(*session);
+        }
+        if (wanted != NO_STEP && wanted != step)
+            return crow::response(404, "Step not current");
+        std::string etag = state_etag(step, hash, format, layout, encoding);
+        crow::response res(304);
+        if (!etag_matches(req.get_header_value("If-None-Match"), etag))
+        {
+            auto frame = shared_frame(format, layout, encoding, *session, false, 0, &step, &hash);
+            if (wanted != NO_STEP && wanted != step)
+                return crow::response(404, "Step not current");
+            res = frame_response(format, encoding, *frame);
+            etag = state_etag(step, hash, format, layout, encoding);
+        }
+        res.set_header("ETag", etag);
+        res.set_header("Cache-Control", "no-cache");
+        res.set_header("Vary", "Accept, Accept-Encoding");
+        return res; });
+
+    // A window of the session's grid, `rows` by `cols` cells from (`row`, `col`), clipped to the grid, so viewers of a
+    // large world only get what they show. With `step`, the window comes from the session's recorded trajectory.
+    CROW_ROUTE(app, "/sessions/<string>/region")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        if (!req.url_params.get("rows") || !req.url_params.get("cols"))
+            return crow::response(400, "Missing region size");
+        uint64_t row = 0, col = 0, rows = 0, cols = 0, wanted = NO_STEP;
+        if (!url_number(req, "row", row) || !url_number(req, "col", col) || !url_number(req, "rows", rows) ||
+            !url_number(req, "cols", cols) || !url_number(req, "step", wanted))
+            return crow::response(400, "Invalid region");
+
+        // Clips the window to a grid, false if nothing of it is left or it is too large
+        auto clip = [&](uint32_t grid_rows, uint32_t grid_cols)
+        {
+            if (row >= grid_rows || col >= grid_cols)
+                return false;
+            rows = std::min<uint64_t>(rows, grid_rows - row);
+            cols = std::min<uint64_t>(cols, grid_cols - col);
+            return rows > 0 && cols > 0 && rows * cols <= MAXIMUM_REGION_CELLS;
+        };
+        grid_t window;
+        uint64_t step;
+        bool live;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            step = session->step;
+            live = wanted == NO_STEP || wanted == step;
+            if (live)
+            {
+                if (!clip(session->grid.rows, session->grid.cols))
+                    return crow::response(400, "Invalid region");
+                window.reset(rows, cols);
+                copy_region(session->grid, row, col, window);
+            }
+        }
+        if (!live)
+        {
+            auto reader = open_trajectory(id);
+            step = wanted;
+            size_t f = reader ? reader->find(step) : 0;
+            if (!reader || f == reader->frames() || (f == reader->frames() - 1 && step > reader->frame(f).step))
+                return crow::response(404, "Step not recorded");
+            if (!clip(reader->rows, reader->cols))
+                return crow::response(400, "Invalid region");
+            window.reset(rows, cols);
+            reader->seek_region(f, row, col, window);
+            step = reader->frame(f).step;
+        }
+        wire_format_t format = wire_format(req);
+        return compressed_response(format, accept_encoding(req), region_body(format, grid_layout(req), window, row, col, step)); });
+
+    // Population statistics of the session, kept up to date by the engine as it writes cells, so a request only
+    // copies them and never waits for a step
+    CROW_ROUTE(app, "/sessions/<string>/stats")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        grid_stats_t stats;
+        uint64_t step;
+        {
+            std::lock_guard<std::mutex> lock(session->stats_mutex);
+            stats = session->stats;
+            step = session->stats_step;
+        }
+        return encoded_response(wire_format(req), stats_json(stats, step)); });
+
+    // Population and energy of the session over steps `from` to `to`, step by step for the recent ones and in
+    // coarser buckets further back
+    CROW_ROUTE(app, "/sessions/<string>/history")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        uint64_t from = 0, to = UINT64_MAX;
+        if (!url_number(req, "from", from) || !url_number(req, "to", to))
+            return crow::response(400, "Invalid range");
+        std::vector<history_bucket_t> buckets;
+        {
+            std::lock_guard<std::mutex> lock(session->stats_mutex);
+            buckets = session->history.range(from, to);
+        }
+        return encoded_response(wire_format(req), history_json(buckets)); });
+
+    // Energy and age distributions of each species at the session's current step: the histograms as the grid keeps
+    // them, and the sketches computed in one pass over the grid once per revision
+    CROW_ROUTE(app, "/sessions/<string>/distributions")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::shared_ptr<const grid_distributions_t> distributions;
+        uint64_t step;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            expire_frames(*session);
+            if (!session->distributions)
+            {
+                session->distributions = std::make_shared<grid_distributions_t>(session->grid);
+            }
+            distributions = session->distributions;
+            step = session->step;
+        }
+        nlohmann::json body = distributions_json(*distributions);
+        body["step"] = step;
+        return encoded_response(wire_format(req), body); });
+
+    // Overview of the session's grid for zoomed out viewers: the counts of each species and the mean energy of every
+    // `block` x `block` block of cells, a few KB even for huge worlds
+    CROW_ROUTE(app, "/sessions/<string>/density")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        uint64_t block = DEFAULT_DENSITY_BLOCK;
+        if (!url_number(req, "block", block) || block == 0)
+            return crow::response(400, "Invalid block size");
+        density_map_t map;
+        uint64_t step;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            const grid_t &grid = session->grid;
+            block = std::min<uint64_t>(block, std::max(grid.rows, grid.cols));
+            if ((grid.rows + block - 1) / block * ((grid.cols + block - 1) / block) > MAXIMUM_REGION_CELLS)
+                return crow::response(400, "Block size too small for the grid");
+            map = density_map(grid, block);
+            step = session->step;
+        }
+        wire_format_t format = wire_format(req);
+        return compressed_response(format == PACKED_FORMAT ? JSON_FORMAT : format, accept_encoding(req), encoded_body(format, density_json(map, step))); });
+
+    CROW_ROUTE(app, "/sessions/<string>/rules")
+        .methods("GET"_method)([](const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::lock_guard<std::mutex> lock(session->mutex);
+        nlohmann::json body = {{"rules", rules_json(session->rules.source)}, {"specialized", session->rules.specialized()}};
+        return crow::response(body.dump()); });
+
+    // Changes the target steps per second of a session, 0 goes back to stepping on request
+    CROW_ROUTE(app, "/sessions/<string>/rate")
+        .methods("POST"_method)([](const crow::request &req, const std::string &id)
+                                {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        double rate = 0;
+        if (!optional_number(request_body, "rate", rate))
+            return crow::response(400, "Invalid rate");
+        scheduler.set_rate(*session, rate);
+        return crow::response(session_json(*session).dump()); });
+
+    // Start parameters, seed and edits of a session, enough to replay it
+    CROW_ROUTE(app, "/sessions/<string>/recording")
+        .methods("GET"_method)([](const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::lock_guard<std::mutex> lock(session->mutex);
+        return crow::response(recording_json(session->recording).dump()); });
+
+    // Overwrites cells or changes rules of a running session, recording the edit at the current step
+    CROW_ROUTE(app, "/sessions/<string>/edits")
+        .methods("POST"_method)([](const crow::request &req, const std::string &id)
+                                {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        session_edit_t edit;
+        if (!parse_edit(request_body, session->grid.rows, session->grid.cols, edit))
+            return crow::response(400, "Invalid edit");
+        session->edit(std::move(edit));
+        return session_response(wire_format(req), grid_layout(req), accept_encoding(req), *session); });
+
+    // Replays a recording headless at full speed and returns the grid after `step` steps
+    CROW_ROUTE(app, "/replay")
+        .methods("POST"_method)([](const crow::request &req)
+                                {
+        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        recording_t recording;
+        if (!request_body.contains("recording") || !parse_recording(request_body.at("recording"), recording) ||
+            recording.rows == 0 || recording.cols == 0 || (uint64_t)recording.rows * recording.cols > MAXIMUM_ENSEMBLE_CELLS ||
+            (uint64_t)recording.plants + recording.herbivores + recording.carnivores > (uint64_t)recording.rows * recording.cols)
+            return crow::response(400, "Invalid recording");
+        // A replay runs on the workers like an ensemble's replica, and has the same limits
+        if (request_body.contains("step") && (!has_counts(request_body, {"step"}) || request_body["step"].get<uint64_t>() > MAXIMUM_ENSEMBLE_STEPS))
+            return crow::response(400, "Invalid step");
+        uint64_t steps = request_body.value("step", (uint64_t)0);
+
+        auto session = std::make_shared<session_t>();
+        auto done = std::make_shared<std::promise<void>>();
+        auto finished = done->get_future();
+        // Run in slices, so that long replays do not hold a worker from the running sessions
+        scheduler.submit_sliced([session, recording, steps, done, k = (uint64_t)0]() mutable
+                                {
+            if (k == 0)
+                session->start(recording, true);
+            for (uint64_t end = std::min(steps, k + slice_steps(session->grid.size())); k < end; k++)
+                session->advance();
+            if (k < steps)
+                return false;
+            done->set_value();
+            return true; },
+                                [done]
+                                { done->set_exception(std::current_exception()); });
+        finished.get();
+        return session_grid_response(wire_format(req), grid_layout(req), accept_encoding(req), *session); });
+
+    // Saves the session's state to its checkpoint file, only the tiles changed since its last checkpoint unless "full"
+    CROW_ROUTE(app, "/sessions/<string>/checkpoint")
+        .methods("POST"_method)([](const crow::request &req, const std::string &id)
+                                {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::string path = checkpoint_path(id);
+        if (path.empty())
+            return crow::response(400, "Invalid session id for a checkpoint");
+        nlohmann::json request_body = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body);
+        std::error_code error;
+        std::filesystem::create_directories(CHECKPOINT_DIRECTORY, error);
+        checkpoint_result_t result;
+        if (!write_checkpoint(*session, path, request_body.value("full", false), result))
+            return crow::response(500, "Could not write checkpoint");
+        nlohmann::json body = {{"session", id}, {"file", path}, {"step", result.step}, {"tiles", result.tiles}, {"tiles_written", result.written}, {"bytes", result.bytes}};
+        return crow::response(body.dump()); });
+
+    // Recreates a session from its checkpoint file, replacing any running session with the same id
+    CROW_ROUTE(app, "/sessions/<string>/restore")
+        .methods("POST"_method)([](const crow::request &req, const std::string &id)
+                                {
+        std::string path = checkpoint_path(id);
+        if (path.empty())
+            return crow::response(400, "Invalid session id for a checkpoint");
+        nlohmann::json request_body = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body);
+        double rate = 0, weight = 1;
+        if (!optional_number(request_body, "rate", rate) || !optional_number(request_body, "weight", weight))
+            return crow::response(400, "Invalid rate or weight");
+        auto session = std::make_shared<session_t>();
+        session->id = id;
+        std::error_code error;
+        std::filesystem::create_directories(MAPPED_GRID_DIRECTORY, error);
+        if (!read_checkpoint(*session, path, MAPPED_GRID_DIRECTORY))
+            return crow::response(404, "No valid checkpoint");
+        crow::response res = session_response(wire_format(req), grid_layout(req), accept_encoding(req), *session);
+        replace_session(session, rate, weight);
+        return res; });
+
+    // Starts recording every step of the session to trajectories/<id>.traj, a keyframe every `keyframe_interval` steps
+    CROW_ROUTE(app, "/sessions/<string>/trajectory")
+        .methods("POST"_method)([](const crow::request &req, const std::string &id)
+                                {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::string path = session_file(TRAJECTORY_DIRECTORY, id, "");
+        if (path.empty())
+            return crow::response(400, "Invalid session id for a trajectory");
+        nlohmann::json request_body = req.body.empty() ? nlohmann::json::object() : nlohmann::json::parse(req.body);
+        std::error_code error;
+        std::filesystem::create_directories(TRAJECTORY_DIRECTORY, error);
+
+        // A recording already running is finished first, as the new one starts its files over
+        std::shared_ptr<trajectory_recorder_t> previous;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            previous = std::move(session->recorder);
+        }
+        if (previous)
+            previous->close();
+
+        auto recorder = std::make_shared<trajectory_recorder_t>(path, request_body.value("keyframe_interval", 100u));
+        if (!recorder->is_open())
+            return crow::response(500, "Could not open trajectory");
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            recorder->capture(session->grid, session->step);
+            session->recorder = recorder;
+        }
+        nlohmann::json body = {{"session", id}, {"file", path + ".traj"}, {"keyframe_interval", recorder->interval()}};
+        return crow::response(body.dump()); });
+
+    CROW_ROUTE(app, "/sessions/<string>/trajectory")
+        .methods("GET"_method)([](const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::shared_ptr<trajectory_recorder_t> recorder;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            recorder = session->recorder;
+        }
+        if (!recorder)
+            return crow::response(404, "Not recording");
+        uint64_t frames, dropped, failed, written, buffered;
+        recorder->stats(frames, dropped, failed, written, buffered);
+        nlohmann::json body = {{"session", id}, {"keyframe_interval", recorder->interval()}, {"frames", frames}, {"frames_dropped", dropped},
+                               {"frames_failed", failed}, {"bytes_written", written}, {"bytes_buffered", buffered}};
+        return crow::response(body.dump()); });
+
+    // Stops recording, once everything captured is on disk
+    CROW_ROUTE(app, "/sessions/<string>/trajectory")
+        .methods("DELETE"_method)([](const std::string &id)
+                                  {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        std::shared_ptr<trajectory_recorder_t> recorder;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            recorder = std::move(session->recorder);
+        }
+        if (!recorder)
+            return crow::response(404, "Not recording");
+        recorder->close();
+        return crow::response(204); });
+
+    // Steps and layout of a recorded trajectory
+    CROW_ROUTE(app, "/trajectories/<string>")
+        .methods("GET"_method)([](const std::string &name)
+                               {
+        auto reader = open_trajectory(name);
+        if (!reader)
+            return crow::response(404);
+        nlohmann::json body = {{"trajectory", name}, {"rows", reader->rows}, {"cols", reader->cols}, {"keyframe_interval", reader->keyframe_interval},
+                               {"frames", reader->frames()}, {"first_step", reader->frame(0).step}, {"last_step", reader->frame(reader->frames() - 1).step}};
+        return crow::response(body.dump()); });
+
+    // The grid of a recorded trajectory at a step, rebuilt from the nearest keyframe before it
+    CROW_ROUTE(app, "/trajectories/<string>/state")
+        .methods("GET"_method)([](const crow::request &req, const std::string &name)
+                               {
+        auto reader = open_trajectory(name);
+        if (!reader)
+            return crow::response(404);
+        uint64_t step = reader->frame(reader->frames() - 1).step;
+        if (!url_number(req, "step", step))
+            return crow::response(400, "Invalid step");
+        size_t f = reader->find(step);
+        if (f == reader->frames() || (f == reader->frames() - 1 && step > reader->frame(f).step))
+            return crow::response(404, "Step not recorded");
+        grid_t grid;
+        reader->seek(f, grid);
+        return grid_response(wire_format(req), grid_layout(req), accept_encoding(req), grid, reader->frame(f).step); });
+
+    // The grids of steps `from` to `to` of a recorded trajectory at `speed` times speed, i.e. every speed-th step,
+    // decoded in one pass from the keyframe before `from`. Packed, the body is the frames' packed layouts back to back.
+    CROW_ROUTE(app, "/trajectories/<string>/range")
+        .methods("GET"_method)([](const crow::request &req, const std::string &name)
+                               {
+        auto reader = open_trajectory(name);
+        if (!reader)
+            return crow::response(404);
+        uint64_t from = reader->frame(0).step, to = reader->frame(reader->frames() - 1).step, speed = 1;
+        if (!url_number(req, "from", from) || !url_number(req, "to", to) || !url_number(req, "speed", speed))
+            return crow::response(400, "Invalid range");
+        speed = std::max<uint64_t>(speed, 1);
+        size_t first = reader->find(from);
+        if (first == reader->frames() || from > to)
+            return crow::response(404, "Steps not recorded");
+
+        wire_format_t format = wire_format(req);
+        grid_layout_t layout = grid_layout(req);
+        content_encoding_t encoding = accept_encoding(req);
+        grid_t grid;
+        reader->seek(first, grid);
+        nlohmann::json frames = nlohmann::json::array();
+        std::string text = "{\"frames\":[", packed;
+        std::vector<uint32_t> occupied;
+        uint64_t next = from;
+        for (size_t f = first, sent = 0; f < reader->frames() && reader->frame(f).step <= to && sent < MAXIMUM_RANGE_FRAMES; f++)
+        {
+            if (f > first)
+                reader->apply(f, grid);
+            if (reader->frame(f).step < next)
+                continue;
+            uint64_t step = reader->frame(f).step;
+            const std::vector<uint32_t> *sparse = sparse_frame(layout, grid, occupied) ? &occupied : nullptr;
+            if (format == PACKED_FORMAT)
+                pack_frame(packed, grid, step, sparse, sparse ? PACKED_SPARSE : 0);
+            else if (format == JSON_FORMAT)
+            {
+                text += sent > 0 ? ",{\"grid\":" : "{\"grid\":";
+                append_json_frame(text, grid, step, sparse, ",\"step\":" + std::to_string(step) + "}");
+            }
+            else
+                frames.push_back({{"step", step}, {"grid", frame_json(grid, step, sparse)}});
+            // Past the last step a frame can have, no later frame is due
+            next = step > UINT64_MAX - speed ? UINT64_MAX : step + speed;
+            sent++;
+        }
+        if (format == PACKED_FORMAT)
+            return compressed_response(format, encoding, std::move(packed));
+        if (format == JSON_FORMAT)
+        {
+            text += "],\"speed\":" + std::to_string(speed) + ",\"trajectory\":" + nlohmann::json(name).dump() + "}";
+            return compressed_response(format, encoding, std::move(text));
+        }
+        return compressed_response(format, encoding, encoded_body(format, {{"trajectory", name}, {"speed", speed}, {"frames", std::move(frames)}})); });
+
+    // Scheduling latency of a session, in microseconds
+    CROW_ROUTE(app, "/sessions/<string>/metrics")
+        .methods("GET"_method)([](const std::string &id)
+                               {
+        auto session = find_session(id);
+        if (!session)
+            return crow::response(404);
+        session_metrics_t metrics = scheduler.metrics(*session);
+        auto latency_json = [](const latency_histogram_t &histogram)
+        {
+            return nlohmann::json{{"mean", histogram.mean()}, {"p50", histogram.quantile(0.5)}, {"p99", histogram.quantile(0.99)}, {"max", histogram.max_us}};
+        };
+        nlohmann::json body = session_json(*session);
+        body["steps"] = metrics.steps;
+        body["step_time_us"] = latency_json(metrics.step_time);
+        body["queue_delay_us"] = latency_json(metrics.queue_delay);
+        return crow::response(body.dump()); });
+
+    // Runs independent seeded replicas headless and returns population statistics per step
+    CROW_ROUTE(app, "/ensemble")
+        .methods("POST"_method)([](const crow::request &req)
+                                {
+        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        ensemble_config_t config;
+        if (!parse_ensemble_config(request_body, config))
+            return crow::response(400, "Invalid ensemble");
+        if (!has_counts(request_body, {"replicas"}) || (request_body.contains("seed") && !has_counts(request_body, {"seed"})))
+            return crow::response(400, "Invalid ensemble");
+        uint32_t replicas = request_body.at("replicas");
+        uint32_t seed = request_body.value("seed", std::random_device{}());
+        if (replicas == 0 || replicas > MAXIMUM_ENSEMBLE_REPLICAS)
+            return crow::response(400, "Invalid ensemble");
+
+        // "auto" picks the batched engine for small worlds, "batched" and "scalar" force one
+        std::string engine = request_body.value("engine", "auto");
+        bool use_batch = engine == "batched" || (engine == "auto" && use_batch_engine(config, replicas));
+        ensemble_stats_t stats = run_ensemble(scheduler, config, replicas, seed, use_batch);
+        if (stats.failed > 0)
+            return crow::response(500, "Ensemble failed");
+
+        nlohmann::json steps = nlohmann::json::array();
+        for (auto &step : stats.steps)
+            steps.push_back(population_stats_json(step));
+        nlohmann::json body = {
+            {"replicas", replicas},
+            {"steps", config.steps},
+            {"seed", seed},
+            {"engine", use_batch ? "batched" : "scalar"},
+            {"extinct_replicas", stats.extinct_replicas},
+            {"extinction_probability", extinction_json(stats)},
+            {"statistics", std::move(steps)},
+            {"distributions", distributions_json(stats.distributions)}};
+        return crow::response(body.dump()); });
+
+    // Starts a sweep over rule parameters, given either as a grid of values or as Latin hypercube ranges
+    CROW_ROUTE(app, "/sweeps")
+        .methods("POST"_method)([](const crow::request &req)
+                                {
+        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        ensemble_config_t config;
+        if (!parse_ensemble_config(request_body, config))
+            return crow::response(400, "Invalid sweep");
+        if ((request_body.contains("replicas") && !has_counts(request_body, {"replicas"})) || (request_body.contains("seed") && !has_counts(request_body, {"seed"})))
+            return crow::response(400, "Invalid sweep");
+        uint32_t replicas = request_body.value("replicas", 1u);
+        uint32_t seed = request_body.value("seed", std::random_device{}());
+        if (replicas == 0 || replicas > MAXIMUM_SWEEP_RUNS)
+            return crow::response(400, "Invalid sweep");
+
+        // The run count is checked before any configuration is built, since a grid's product grows with every axis
+        std::vector<sweep_configuration_t> configurations;
+        if (request_body.contains("grid") && request_body["grid"].is_object())
+        {
+            std::vector<std::pair<const rule_parameter_t *, std::vector<double>>> axes;
+            uint64_t runs = replicas, points = 1;
+            for (auto &axis : request_body["grid"].items())
+            {
+                const rule_parameter_t *parameter = find_rule_parameter(axis.key());
+                if (!parameter)
+                    return crow::response(400, "Unknown parameter " + axis.key());
+                const nlohmann::json &values = axis.value();
+                if (!values.is_array() || values.empty() || !std::all_of(values.begin(), values.end(), [](const nlohmann::json &v)
+                                                                          { return v.is_number(); }))
+                    return crow::response(400, "Invalid values for " + axis.key());
+                // Both factors are at most MAXIMUM_SWEEP_RUNS here, so the product cannot overflow
+                runs *= values.size() <= MAXIMUM_SWEEP_RUNS ? values.size() : (uint64_t)MAXIMUM_SWEEP_RUNS + 1;
+                points *= values.size() <= MAXIMUM_SWEEP_CONFIGURATIONS ? values.size() : (uint64_t)MAXIMUM_SWEEP_CONFIGURATIONS + 1;
+                if (runs > MAXIMUM_SWEEP_RUNS || points > MAXIMUM_SWEEP_CONFIGURATIONS)
+                    return crow::response(400, "Too many sweep runs");
+                axes.emplace_back(parameter, values.get<std::vector<double>>());
+            }
+            configurations = grid_configurations(axes);
+        }
+        else if (request_body.contains("latin_hypercube") && request_body["latin_hypercube"].is_object())
+        {
+            const nlohmann::json &lhs = request_body["latin_hypercube"];
+            if (!lhs.contains("ranges") || !lhs["ranges"].is_object() || (lhs.contains("samples") && !has_counts(lhs, {"samples"})))
+                return crow::response(400, "Invalid sweep");
+            uint32_t samples = lhs.value("samples", 1u);
+            if ((uint64_t)samples * replicas > MAXIMUM_SWEEP_RUNS || samples > MAXIMUM_SWEEP_CONFIGURATIONS)
+                return crow::response(400, "Too many sweep runs");
+            std::vector<std::pair<const rule_parameter_t *, std::pair<double, double>>> ranges;
+            for (auto &range : lhs["ranges"].items())
+            {
+                const rule_parameter_t *parameter = find_rule_parameter(range.key());
+                const nlohmann::json &bounds = range.value();
+                if (!parameter || !bounds.is_array() || bounds.size() != 2 || !bounds[0].is_number() || !bounds[1].is_number())
+                    return crow::response(400, "Invalid range for " + range.key());
+                ranges.emplace_back(parameter, std::make_pair(bounds[0].get<double>(), bounds[1].get<double>()));
+            }
+            std::mt19937 gen(seed);
+            configurations = latin_hypercube_configurations(ranges, samples, gen);
+        }
+        if (configurations.empty())
+            return crow::response(400, "Invalid sweep");
+
+        auto sweep = std::make_shared<sweep_t>(config, std::move(configurations), replicas, seed);
+        std::string id;
+        {
+            std::lock_guard<std::mutex> lock(sweeps_mutex);
+            auto expired = steady_clock_t::now() - SWEEP_RETENTION;
+            for (auto it = sweeps.begin(); it != sweeps.end();)
+                it = it->second->finished_before(expired) ? sweeps.erase(it) : std::next(it);
+            if (sweeps.size() >= MAXIMUM_SWEEPS)
+                return crow::response(503, "Too many sweeps");
+            id = std::to_string(next_sweep_id++);
+            sweeps[id] = sweep;
+        }
+        sweep->start(scheduler);
+        return crow::response(nlohmann::json{{"sweep", id}, {"configurations", sweep->size()}, {"replicas", replicas}, {"seed", seed}}.dump()); });
+
+    // Summaries of the configurations finished since the `from`-th one, so clients can poll them as they complete
+    CROW_ROUTE(app, "/sweeps/<string>")
+        .methods("GET"_method)([](const crow::request &req, const std::string &id)
+                               {
+        std::shared_ptr<sweep_t> sweep;
+        {
+            std::lock_guard<std::mutex> lock(sweeps_mutex);
+            auto it = sweeps.find(id);
+            if (it == sweeps.end())
+                return crow::response(404);
+            sweep = it->second;
+        }
+        uint64_t from = 0;
+        if (!url_number(req, "from", from))
+            return crow::response(400, "Invalid from");
+        bool done;
+        auto results = sweep->results(std::min<uint64_t>(from, SIZE_MAX), done);
+
+        nlohmann::json results_json = nlohmann::json::array();
+        for (auto &result : results)
+        {
+            // Report the values as the engine used them, after rounding and clamping
+            rule_set_t rules;
+            nlohmann::json parameters = nlohmann::json::object();
+            for (auto &parameter : sweep->configuration(result.first))
+            {
+                set_rule_parameter(rules, *parameter.first, parameter.second);
+                parameters[parameter.first->name] = rule_parameter_json(rules, *parameter.first);
+            }
+            results_json.push_back({{"configuration", result.first},
+                                    {"parameters", std::move(parameters)},
+                                    {"final", population_stats_json(result.second.steps.back())},
+                                    {"extinction_probability", extinction_json(result.second)},
+                                    {"failed_replicas", result.second.failed}});
+        }
+        nlohmann::json body = {{"sweep", id}, {"configurations", sweep->size()}, {"from", from}, {"next", from + results.size()}, {"done", done}, {"results", std::move(results_json)}};
+        return crow::response(body.dump()); });
+
+    CROW_ROUTE(app, "/sweeps/<string>")
+        .methods("DELETE"_method)([](const std::string &id)
+                                  {
+        std::lock_guard<std::mutex> lock(sweeps_mutex);
+        auto it = sweeps.find(id);
+        if (it == sweeps.end())
+            return crow::response(404);
+        it->second->cancel();
+        sweeps.erase(it);
+        return crow::response(204); });
+
+    // Frame stream: after a {"session", "format", "layout"} message, pushes the session's frame after each of its
+    // steps, at the cadence the session runs at. The first frame holds the whole grid, the next ones only the
+    // cells changed since, as from /next-iteration?since=.
+    CROW_ROUTE(app, "/stream")
+        .websocket()
+        .onmessage([](crow::websocket::connection &connection, const std::string &message, bool)
+                   {
+        nlohmann::json request_body = nlohmann::json::parse(message, nullptr, false);
+        if (!request_body.is_object() || !request_body.value("session", nlohmann::json(DEFAULT_SESSION)).is_string() ||
+            !request_body.value("format", nlohmann::json("json")).is_string() || !request_body.value("layout", nlohmann::json("dense")).is_string()) {
+        connection.close("Invalid subscription");
+        return;
+        }
+        std::string id = request_body.value("session", DEFAULT_SESSION);
+        {
+            std::lock_guard<std::mutex> lock(subscribers_mutex);
+            subscriber_t &subscriber = subscribers[&connection];
+            subscriber = subscriber_t();
+            subscriber.session = id;
+            subscriber.format = parse_format(request_body.value("format", "json"));
+            subscriber.layout = parse_layout(request_body.value("layout", "dense").c_str());
+        }
+        if (auto session = find_session(id))
+            send_frame(connection, session); })
+        .onclose([](crow::websocket::connection &connection, const std::string &)
+                 {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        subscribers.erase(&connection); });
+
+    app.port(8080).concurrency(HTTP_THREADS).run();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// An entity written into one cell of a running session
+struct cell_edit_t
+{
+    uint32_t row;
+    uint32_t col;
+    entity_t entity;
+};
+
+// Changes made to a session between two steps, after `step` steps had run
+struct session_edit_t
+{
+    uint64_t step = 0;
+    std::vector<cell_edit_t> cells;
+    std::vector<std::pair<const rule_parameter_t *, double>> rules;
+};
+
+// Everything a session's grids depend on: the start parameters, including the seed of its generator, and the
+// edits made since. The engine is deterministic for a given seed, so replaying a recording reproduces the same
+// sequence of grids without logging any draw.
+struct recording_t
+{
+    uint32_t rows = NUM_ROWS;
+    uint32_t cols = NUM_ROWS;
+    uint32_t plants = 0;
+    uint32_t herbivores = 0;
+    uint32_t carnivores = 0;
+    uint32_t seed = 0;
+    rule_set_t rules;
+    std::vector<session_edit_t> edits; // In step order
+};
+
+inline void apply_edit(grid_t &grid, compiled_rules_t &rules, const session_edit_t &edit)
+{
+    for (auto &cell : edit.cells)
+        grid.set(grid.index(cell.row, cell.col), cell.entity);
+    if (edit.rules.empty())
+        return;
+    rule_set_t source = rules.source;
+    for (auto &parameter : edit.rules)
+        set_rule_parameter(source, *parameter.first, parameter.second);
+    rules = compiled_rules_t(source);
+    // New limits bin the histograms differently
+    if (grid.track_histograms(source))
+        grid.recount();
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "session.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Multiplexes the steps of every session, and any background task, onto a fixed pool of workers.
+//
+// Sessions with a rate target become runnable each time a step is due; any session becomes runnable
+// when a client requests a step. Runnable sessions are served in start-time fair queueing order with
+// a step's cost proportional to the world size, so a giant world gets the same share of the workers
+// as a small one instead of starving it. Background tasks only run when no session step is runnable, and
+// are not preempted, so long ones are submitted as slices that each return to the scheduler.
+class scheduler_t
+{
+public:
+    explicit scheduler_t(unsigned num_workers = std::thread::hardware_concurrency())
+    {
+        num_workers = std::max(1u, num_workers);
+        for (unsigned k = 0; k < num_workers; k++)
+            workers.emplace_back([this]
+                                 { worker_loop(); });
+    }
+
+    ~scheduler_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    unsigned size() const { return workers.size(); }
+
+    void add(const std::shared_ptr<session_t> &session, double rate, double weight)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        session->weight = weight > 0 ? weight : 1;
+        session->finish_tag = virtual_time;
+        set_rate_locked(*session, rate);
+        sessions.push_back(session);
+        wakeup.notify_all();
+    }
+
+    // Stops stepping the session, once any step in flight has finished, and releases every client waiting for a step
+    void remove(const std::shared_ptr<session_t> &session)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        session->removed = true;
+        idle.wait(lock, [&]
+                  { return !session->in_flight; });
+        sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+        for (auto &request : session->requests)
+            request.done.set_value();
+        session->requests.clear();
+    }
+
+    void set_rate(session_t &session, double rate)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        set_rate_locked(session, rate);
+        wakeup.notify_all();
+    }
+
+    // Queues one step of the session and returns a future that is ready once it has run, or at once if the session
+    // was removed
+    std::future<void> request_step(session_t &session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (session.removed)
+        {
+            std::promise<void> done;
+            done.set_value();
+            return done.get_future();
+        }
+        session.requests.push_back({std::promise<void>(), steady_clock_t::now()});
+        auto done = session.requests.back().done.get_future();
+        wakeup.notify_one();
+        return done;
+    }
+
+    // Runs a background task on the workers, behind any runnable session step
+    void submit(std::function<void()> task)
+    {
+        submit_sliced([task = std::move(task)]
+                      { task(); return true; });
+    }
+
+    // Runs `slice` on the workers until it returns true, each call behind any session step that became runnable
+    // meanwhile. A started task's next slice goes ahead of the tasks still waiting, so that tasks finish in the
+    // order they started. If a slice throws, the task is dropped and `failed` is called inside the catch block, where
+    // std::current_exception() still holds the error.
+    void submit_sliced(std::function<bool()> slice, std::function<void()> failed = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back({std::move(slice), std::move(failed)});
+        wakeup.notify_one();
+    }
+
+    // Sets a function called on the worker after every session step, before any client waiting for it is
+    // released; it must be set before the first session is added
+    void on_step(std::function<void(session_t &)> listener) { step_listener = std::move(listener); }
+
+    session_metrics_t metrics(const session_t &session)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return session.metrics;
+    }
+
+private:
+    void set_rate_locked(session_t &session, double rate)
+    {
+        session.rate = rate > 0 ? rate : 0;
+        session.due = steady_clock_t::now();
+    }
+
+    static steady_clock_t::duration period(const session_t &session)
+    {
+        return std::chrono::duration_cast<steady_clock_t::duration>(std::chrono::duration<double>(1.0 / session.rate));
+    }
+
+    // Picks the runnable session with the smallest start tag, or nullptr; `next_due` gets the earliest future deadline
+    std::shared_ptr<session_t> pick(steady_clock_t::time_point now, steady_clock_t::time_point &next_due)
+    {
+        std::shared_ptr<session_t> best;
+        double best_tag = 0;
+        for (auto &session : sessions)
+        {
+            if (session->in_flight)
+                continue;
+            bool runnable = !session->requests.empty();
+            if (!runnable && session->rate > 0)
+            {
+                if (session->due <= now)
+                    runnable = true;
+                else
+                    next_due = std::min(next_due, session->due);
+            }
+            if (!runnable)
+                continue;
+            double tag = std::max(virtual_time, session->finish_tag);
+            if (!best || tag < best_tag)
+            {
+                best = session;
+                best_tag = tag;
+            }
+        }
+        if (best)
+        {
+            virtual_time = best_tag;
+            best->finish_tag = best_tag + best->step_cost();
+        }
+        return best;
+    }
+
+    void run_step(std::unique_lock<std::mutex> &lock, session_t &session, steady_clock_t::time_point now)
+    {
+        // A client request is served first; otherwise this is the step that was due
+        steady_clock_t::time_point since = session.due;
+        bool requested = !session.requests.empty();
+        if (requested)
+            since = session.requests.front().requested;
+        else
+            session.due = std::max(session.due + period(session), now - period(session));
+        session.in_flight = true;
+        lock.unlock();
+
+        auto start = steady_clock_t::now();
+        session.advance();
+        auto end = steady_clock_t::now();
+        if (step_listener)
+            step_listener(session);
+
+        lock.lock();
+        session.in_flight = false;
+        session.metrics.steps++;
+        session.metrics.queue_delay.add(std::chrono::duration<double, std::micro>(start - std::min(since, start)).count());
+        session.metrics.step_time.add(std::chrono::duration<double, std::micro>(end - start).count());
+        if (requested)
+        {
+            session.requests.front().done.set_value();
+            session.requests.pop_front();
+        }
+        idle.notify_all();
+    }
+
+    void worker_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            auto now = steady_clock_t::now();
+            auto next_due = steady_clock_t::time_point::max();
+            if (auto session = pick(now, next_due))
+            {
+                run_step(lock, *session, now);
+                continue;
+            }
+            if (!tasks.empty())
+            {
+                task_t task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                bool finished = true;
+                try
+                {
+                    finished = task.slice();
+                }
+                catch (...)
+                {
+                    if (task.failed)
+                        task.failed();
+                }
+                lock.lock();
+                if (!finished)
+                    tasks.push_front(std::move(task));
+                continue;
+            }
+            if (next_due == steady_clock_t::time_point::max())
+                wakeup.wait(lock);
+            else
+                wakeup.wait_until(lock, next_due);
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+    bool stopping = false;
+    double virtual_time = 0;
+    std::vector<std::shared_ptr<session_t>> sessions;
+    struct task_t
+    {
+        std::function<bool()> slice;
+        std::function<void()> failed;
+    };
+    std::deque<task_t> tasks;
+    std::function<void(session_t &)> step_listener;
+    std::vector<std::thread> workers;
+};
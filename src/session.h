@@ -0,0 +1,276 @@
+#pragma once
+
+#include "history.h"
+#include "recording.h"
+#include "simulation.h"
+#include "sketch.h"
+#include "trajectory.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using steady_clock_t = std::chrono::steady_clock;
+
+// Log2-bucketed histogram of latencies in microseconds (bucket k holds [2^k, 2^(k+1)) us)
+struct latency_histogram_t
+{
+    std::array<uint64_t, 40> buckets{};
+    uint64_t count = 0;
+    double total_us = 0;
+    double max_us = 0;
+
+    void add(double us)
+    {
+        uint32_t k = us < 1 ? 0 : std::min<uint32_t>((uint32_t)std::log2(us), buckets.size() - 1);
+        buckets[k]++;
+        count++;
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+
+    double mean() const { return count ? total_us / count : 0; }
+
+    // Upper bound of the bucket holding the q-th quantile
+    double quantile(double q) const
+    {
+        uint64_t rank = (uint64_t)std::ceil(q * count), seen = 0;
+        for (uint32_t k = 0; k < buckets.size(); k++)
+        {
+            seen += buckets[k];
+            if (seen >= rank && seen > 0)
+                return std::min(std::ldexp(1.0, k + 1), max_us);
+        }
+        return 0;
+    }
+};
+
+struct session_metrics_t
+{
+    uint64_t steps = 0;
+    // Time spent inside the step kernel
+    latency_histogram_t step_time;
+    // Time between a step becoming due (or being requested) and a worker starting it
+    latency_histogram_t queue_delay;
+};
+
+// A step requested by a client, completed once a worker has run it
+struct step_request_t
+{
+    std::promise<void> done;
+    steady_clock_t::time_point requested;
+};
+
+// Steps back that a client can ask for the cells changed since, and the memory the history of those steps may
+// take; the oldest steps are dropped once it is over either, though the last step is always kept
+static const size_t DIRTY_HISTORY_STEPS = 32;
+static const size_t DIRTY_HISTORY_BYTES = 4 << 20;
+
+// Cells written by one step: their indices when few changed, otherwise a bit per cell of the grid
+struct dirty_step_t
+{
+    std::vector<uint32_t> cells;
+    std::vector<uint64_t> bits;
+
+    size_t bytes() const { return cells.capacity() * sizeof(uint32_t) + bits.capacity() * sizeof(uint64_t); }
+};
+
+// One independent simulated world
+struct session_t
+{
+    std::string id;
+
+    // Guards grid, rules, gen, step, revision, recording, replay, the checkpoint state, the recorder, the dirty
+    // history and the encoded frames
+    std::mutex mutex;
+    grid_t grid;
+    compiled_rules_t rules;
+    std::mt19937 gen;
+    uint64_t step = 0;
+    recording_t recording;
+    std::deque<session_edit_t> replay; // Recorded edits still to apply, when replaying
+    std::string checkpoint_path; // File of the last checkpoint, with the hash of each of its tiles
+    std::vector<uint64_t> checkpoint_hashes;
+    std::shared_ptr<trajectory_recorder_t> recorder; // Records every step when set
+    std::deque<dirty_step_t> dirty_history; // Cells written by each of the last steps, oldest first
+    size_t dirty_history_bytes = 0;
+    uint64_t revision = 0;                           // Bumped by every change: a start, a step or an edit
+    // Frames of the current revision as sent to clients, by format, layout, compression, whether a delta and since
+    // which step (UINT64_MAX for any step the dirty history does not reach, which all get the whole grid), encoded
+    // once for all the clients asking for the same one
+    using frame_key_t = std::tuple<int, int, int, bool, uint64_t>;
+    uint64_t frames_revision = 0;
+    std::map<frame_key_t, std::shared_ptr<const std::string>> frames;
+    uint64_t frames_hash = 0; // Fingerprint of the grid at that revision, 0 until computed
+    std::shared_ptr<const grid_distributions_t> distributions; // Of the grid at that revision, null until computed
+
+    // Copy of grid.stats and step as of the last change, and the history of the stats at each step, so that
+    // reading them never waits for a step
+    std::mutex stats_mutex;
+    grid_stats_t stats;
+    uint64_t stats_step = 0;
+    population_history_t history;
+
+    // Scheduling state, guarded by the scheduler
+    std::atomic<double> rate{0}; // Target steps per second, 0 only steps on request (also read by handlers)
+    double weight = 1;           // Share of the workers relative to other sessions of the same size
+    steady_clock_t::time_point due;
+    double finish_tag = 0;
+    bool in_flight = false;
+    bool removed = false; // Taken off the scheduler; step requests are answered at once
+    std::deque<step_request_t> requests;
+    session_metrics_t metrics;
+
+    // Cost of one step, used to share the workers fairly between worlds of different sizes
+    double step_cost() const { return (double)grid.size() / weight; }
+
+    // Sets up the initial grid of a recording; with `replay` its edits are applied again at their steps
+    void start(const recording_t &source, bool replay_edits)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        recording = source;
+        rules = compiled_rules_t(recording.rules);
+        gen.seed(recording.seed);
+        // A freshly mapped grid is already empty, and clearing it would page in the whole file
+        if (!grid.mapped())
+            grid.reset(recording.rows, recording.cols);
+        if (grid.track_histograms(recording.rules))
+            grid.recount();
+        populate_grid(grid, recording.rules, recording.plants, recording.herbivores, recording.carnivores, gen);
+        step = 0;
+        replay.clear();
+        if (replay_edits)
+            replay.assign(recording.edits.begin(), recording.edits.end());
+        else
+            recording.edits.clear();
+        apply_replayed_edits();
+        std::fill(grid.dirty.begin(), grid.dirty.end(), 0);
+        dirty_history.clear();
+        dirty_history_bytes = 0;
+        revision++;
+        publish_stats();
+    }
+
+    // Applies and records an edit made now
+    void edit(session_edit_t change)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        change.step = step;
+        apply_edit(grid, rules, change);
+        // An edit during a replay branches off the recording: the recorded edits it had not reached are dropped
+        recording.edits.resize(recording.edits.size() - replay.size());
+        replay.clear();
+        recording.edits.push_back(std::move(change));
+        revision++;
+        publish_stats();
+    }
+
+    void advance()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        simulate_step(grid, rules, gen);
+        step++;
+        revision++;
+        apply_replayed_edits();
+        if (recorder)
+            recorder->capture(grid, step);
+        publish_stats();
+
+        // Mapped worlds keep no history: a bit per cell and step would put back on the heap much of what mapping
+        // keeps off it, and their clients get whole frames anyway
+        if (grid.mapped())
+            std::fill(grid.dirty.begin(), grid.dirty.end(), 0);
+        else
+            record_dirty();
+    }
+
+    // Copies the grid's stats for readers of stats and adds them to the history, started over with `new_history`;
+    // mutex must be held
+    void publish_stats(bool new_history = false)
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats = grid.stats;
+        stats_step = step;
+        if (new_history)
+            history.clear();
+        history.add(step, stats);
+    }
+
+    // Whether the dirty history reaches back to step `since`
+    bool history_covers(uint64_t since) const { return since <= step && step - since <= dirty_history.size(); }
+
+    // Cells written after step `since`, including edits since the last step. Returns false when that is
+    // further back than the history goes, and the client needs the whole grid instead.
+    bool changed_since(uint64_t since, std::vector<uint32_t> &cells) const
+    {
+        if (!history_covers(since))
+            return false;
+        std::vector<uint64_t> changed = grid.dirty;
+        for (size_t k = dirty_history.size() - (step - since); k < dirty_history.size(); k++)
+        {
+            const dirty_step_t &entry = dirty_history[k];
+            for (uint32_t idx : entry.cells)
+                changed[idx >> 6] |= 1ull << (idx & 63);
+            for (size_t w = 0; w < entry.bits.size(); w++)
+                changed[w] |= entry.bits[w];
+        }
+        for (size_t w = 0; w < changed.size(); w++)
+            for (uint64_t bits = changed[w]; bits; bits &= bits - 1)
+                cells.push_back(w * 64 + __builtin_ctzll(bits));
+        return true;
+    }
+
+private:
+    // Moves the step's dirty cells into the history, as a list when that is smaller than the bitset, and clears them
+    void record_dirty()
+    {
+        size_t count = 0;
+        for (uint64_t word : grid.dirty)
+            count += __builtin_popcountll(word);
+        dirty_step_t entry;
+        bool dense = count * sizeof(uint32_t) >= grid.dirty.size() * sizeof(uint64_t);
+        if (dense)
+            entry.bits = std::move(grid.dirty);
+        else
+        {
+            entry.cells.reserve(count);
+            for (size_t w = 0; w < grid.dirty.size(); w++)
+                for (uint64_t bits = grid.dirty[w]; bits; bits &= bits - 1)
+                    entry.cells.push_back(w * 64 + __builtin_ctzll(bits));
+        }
+        size_t words = entry.bits.size() + (dense ? 0 : grid.dirty.size());
+        dirty_history_bytes += entry.bytes();
+        dirty_history.push_back(std::move(entry));
+
+        // A dropped bitset is reused as the next step's dirty bits
+        std::vector<uint64_t> spare;
+        while (dirty_history.size() > DIRTY_HISTORY_STEPS || (dirty_history.size() > 1 && dirty_history_bytes > DIRTY_HISTORY_BYTES))
+        {
+            dirty_history_bytes -= dirty_history.front().bytes();
+            if (spare.empty())
+                spare = std::move(dirty_history.front().bits);
+            dirty_history.pop_front();
+        }
+        if (dense)
+            grid.dirty = std::move(spare);
+        grid.dirty.assign(words, 0);
+    }
+
+    void apply_replayed_edits()
+    {
+        while (!replay.empty() && replay.front().step <= step)
+        {
+            apply_edit(grid, rules, replay.front());
+            replay.pop_front();
+        }
+    }
+};
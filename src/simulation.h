@@ -0,0 +1,869 @@
+#pragma once
+
+#include "field.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const uint32_t NUM_ROWS = 15;
+
+// Rules of a simulation, supplied per session; the defaults are the rules described in the README
+struct rule_set_t
+{
+    // Constants
+    uint32_t plant_maximum_age = 10;
+    uint32_t herbivore_maximum_age = 50;
+    uint32_t carnivore_maximum_age = 80;
+    uint32_t maximum_energy = 200;
+    uint32_t threshold_energy_for_reproduction = 20;
+    uint32_t initial_energy = 100;
+    uint32_t move_energy_cost = 5;
+    uint32_t reproduction_energy_cost = 10;
+    uint32_t herbivore_eat_energy_gain = 30;
+    uint32_t carnivore_eat_energy_gain = 20;
+
+    // Probabilities
+    double plant_reproduction_probability = 0.2;
+    double herbivore_reproduction_probability = 0.075;
+    double carnivore_reproduction_probability = 0.025;
+    double herbivore_move_probability = 0.7;
+    double herbivore_eat_probability = 0.9;
+    double carnivore_move_probability = 0.5;
+    double carnivore_eat_probability = 1.0;
+};
+
+static constexpr rule_set_t DEFAULT_RULES{};
+
+// Names of the rule parameters in requests that override them
+struct rule_parameter_t
+{
+    const char *name;
+    uint32_t rule_set_t::*integer;
+    double rule_set_t::*probability;
+};
+
+static const rule_parameter_t RULE_PARAMETERS[] = {
+    {"PLANT_MAXIMUM_AGE", &rule_set_t::plant_maximum_age, nullptr},
+    {"HERBIVORE_MAXIMUM_AGE", &rule_set_t::herbivore_maximum_age, nullptr},
+    {"CARNIVORE_MAXIMUM_AGE", &rule_set_t::carnivore_maximum_age, nullptr},
+    {"MAXIMUM_ENERGY", &rule_set_t::maximum_energy, nullptr},
+    {"THRESHOLD_ENERGY_FOR_REPRODUCTION", &rule_set_t::threshold_energy_for_reproduction, nullptr},
+    {"INITIAL_ENERGY", &rule_set_t::initial_energy, nullptr},
+    {"MOVE_ENERGY_COST", &rule_set_t::move_energy_cost, nullptr},
+    {"REPRODUCTION_ENERGY_COST", &rule_set_t::reproduction_energy_cost, nullptr},
+    {"HERBIVORE_EAT_ENERGY_GAIN", &rule_set_t::herbivore_eat_energy_gain, nullptr},
+    {"CARNIVORE_EAT_ENERGY_GAIN", &rule_set_t::carnivore_eat_energy_gain, nullptr},
+    {"PLANT_REPRODUCTION_PROBABILITY", nullptr, &rule_set_t::plant_reproduction_probability},
+    {"HERBIVORE_REPRODUCTION_PROBABILITY", nullptr, &rule_set_t::herbivore_reproduction_probability},
+    {"CARNIVORE_REPRODUCTION_PROBABILITY", nullptr, &rule_set_t::carnivore_reproduction_probability},
+    {"HERBIVORE_MOVE_PROBABILITY", nullptr, &rule_set_t::herbivore_move_probability},
+    {"HERBIVORE_EAT_PROBABILITY", nullptr, &rule_set_t::herbivore_eat_probability},
+    {"CARNIVORE_MOVE_PROBABILITY", nullptr, &rule_set_t::carnivore_move_probability},
+    {"CARNIVORE_EAT_PROBABILITY", nullptr, &rule_set_t::carnivore_eat_probability},
+};
+
+inline const rule_parameter_t *find_rule_parameter(const std::string &name)
+{
+    for (auto &parameter : RULE_PARAMETERS)
+        if (name == parameter.name)
+            return &parameter;
+    return nullptr;
+}
+
+// Sets a rule parameter, rounding integer ones into [0, INT32_MAX] and clamping probabilities to [0, 1]
+inline void set_rule_parameter(rule_set_t &rules, const rule_parameter_t &parameter, double value)
+{
+    if (parameter.integer)
+        rules.*parameter.integer = (uint32_t)std::llround(std::min(std::max(value, 0.0), (double)INT32_MAX));
+    else
+        rules.*parameter.probability = std::min(std::max(value, 0.0), 1.0);
+}
+
+// Type definitions
+enum entity_type_t : uint8_t
+{
+    empty,
+    plant,
+    herbivore,
+    carnivore
+};
+
+struct pos_t
+{
+    uint32_t i;
+    uint32_t j;
+};
+
+struct entity_t
+{
+    entity_type_t type;
+    int32_t energy;
+    int32_t age;
+};
+
+// Number, total energy and total age of the entities of each type in a grid, indexed by entity_type_t
+struct grid_stats_t
+{
+    std::array<uint64_t, 4> count{};
+    std::array<int64_t, 4> energy{};
+    std::array<int64_t, 4> age{};
+
+    void add(const entity_t &e)
+    {
+        count[e.type]++;
+        energy[e.type] += e.energy;
+        age[e.type] += e.age;
+    }
+
+    void remove(const entity_t &e)
+    {
+        count[e.type]--;
+        energy[e.type] -= e.energy;
+        age[e.type] -= e.age;
+    }
+};
+
+// Bins of a fixed histogram, spread evenly over [0, limit]
+static const uint32_t HISTOGRAM_BINS = 32;
+
+// Histogram over [0, limit] in HISTOGRAM_BINS equal bins; values outside land in the first or last bin
+struct fixed_histogram_t
+{
+    int32_t limit = 0;
+    std::array<uint64_t, HISTOGRAM_BINS> counts{};
+
+    fixed_histogram_t() = default;
+    explicit fixed_histogram_t(int32_t range) : limit(range), scale(((uint64_t)HISTOGRAM_BINS << 32) / ((uint64_t)range + 1)) {}
+
+    // value * HISTOGRAM_BINS / (limit + 1) with a multiplication instead of a division, since every write to the
+    // grid bins a few values: the scaled estimate is at most one short, which the check corrects
+    uint32_t bin(int32_t value) const
+    {
+        uint64_t clamped = (uint64_t)std::min<int64_t>(std::max<int64_t>(value, 0), limit);
+        uint64_t b = clamped * scale >> 32;
+        if ((b + 1) * ((uint64_t)limit + 1) <= clamped * HISTOGRAM_BINS)
+            b++;
+        return (uint32_t)b;
+    }
+
+    void add(int32_t value) { counts[bin(value)]++; }
+    void remove(int32_t value) { counts[bin(value)]--; }
+
+    // Moves a value that changed from `from` to `to`, which most changes leave in the same bin
+    void move(int32_t from, int32_t to)
+    {
+        uint32_t a = bin(from), b = bin(to);
+        if (a != b)
+        {
+            counts[a]--;
+            counts[b]++;
+        }
+    }
+
+    // Histograms of different ranges cannot be merged, and leave this one as it is
+    bool merge(const fixed_histogram_t &other)
+    {
+        if (other.limit != limit)
+            return false;
+        for (uint32_t b = 0; b < HISTOGRAM_BINS; b++)
+            counts[b] += other.counts[b];
+        return true;
+    }
+private:
+    uint64_t scale = (uint64_t)HISTOGRAM_BINS << 32; // 2^32 * HISTOGRAM_BINS / (limit + 1), rounded down
+};
+
+// Energy and age histograms of the entities of each type, indexed by entity_type_t (empty unused). They span
+// [0, maximum energy] and [0, the species' maximum age] of the rules, the ranges the step keeps the values in.
+struct grid_histograms_t
+{
+    bool enabled = false;
+    std::array<fixed_histogram_t, 4> energy;
+    std::array<fixed_histogram_t, 4> age;
+
+    grid_histograms_t() = default;
+    explicit grid_histograms_t(const rule_set_t &rules) : enabled(true)
+    {
+        const uint32_t maximum_age[4] = {0, rules.plant_maximum_age, rules.herbivore_maximum_age, rules.carnivore_maximum_age};
+        for (int type = plant; type <= carnivore; type++)
+        {
+            energy[type] = fixed_histogram_t((int32_t)std::min<uint32_t>(rules.maximum_energy, INT32_MAX - 1));
+            age[type] = fixed_histogram_t((int32_t)std::min<uint32_t>(maximum_age[type], INT32_MAX - 1));
+        }
+    }
+
+    bool same_ranges(const grid_histograms_t &other) const
+    {
+        for (int type = plant; type <= carnivore; type++)
+            if (energy[type].limit != other.energy[type].limit || age[type].limit != other.age[type].limit)
+                return false;
+        return enabled == other.enabled;
+    }
+
+    void clear()
+    {
+        for (int type = plant; type <= carnivore; type++)
+        {
+            energy[type].counts.fill(0);
+            age[type].counts.fill(0);
+        }
+    }
+
+    void add(const entity_t &e)
+    {
+        if (e.type == empty)
+            return;
+        energy[e.type].add(e.energy);
+        age[e.type].add(e.age);
+    }
+
+    void remove(const entity_t &e)
+    {
+        if (e.type == empty)
+            return;
+        energy[e.type].remove(e.energy);
+        age[e.type].remove(e.age);
+    }
+};
+
+// Marks "no cell" when looking for a neighbour
+static const uint32_t NO_CELL = UINT32_MAX;
+
+// Bytes of the grid a mapped step streams through between paging hints
+static const uint32_t GRID_STREAM_BYTES = 4 << 20;
+
+// Grid that contains the entities, one flat array per field (row-major), on the heap or in a mapped file
+struct grid_t
+{
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    field_t<entity_type_t> type;
+    field_t<int32_t> energy;
+    field_t<int32_t> age;
+    // Set for entities that already acted during the current step
+    field_t<uint8_t> acted;
+    // Rows stepped between two paging hints; a heap grid is a single band
+    uint32_t band_rows = 0;
+    // One bit per cell written since the bits were last cleared, so clients can be sent only what changed
+    std::vector<uint64_t> dirty;
+    // Kept up to date by every write through set() and set_energy(), and by the step for the ages it increments;
+    // code filling the fields directly calls recount() afterwards
+    grid_stats_t stats;
+    // Kept up to date the same way once track_histograms() set their ranges; off for grids no one asks them of
+    grid_histograms_t histograms;
+
+    void reset(uint32_t num_rows, uint32_t num_cols)
+    {
+        rows = num_rows;
+        cols = num_cols;
+        type.assign(size(), empty);
+        energy.assign(size(), 0);
+        age.assign(size(), 0);
+        acted.assign(size(), 0);
+        dirty.assign((size() + 63) / 64, 0);
+        stats = grid_stats_t();
+        stats.count[empty] = size();
+        histograms.clear();
+        if (!type.mapped())
+            band_rows = rows;
+    }
+
+    // Backs an empty grid with a scratch file created in `directory`, which is deleted once the grid is gone.
+    // The fields are laid out one after the other, each page aligned; a fresh file reads as zeros, an empty grid.
+    bool map_file(const std::string &directory, uint32_t num_rows, uint32_t num_cols)
+    {
+        std::string path = directory + "/grid-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0)
+            return false;
+        unlink(path.c_str());
+
+        size_t cells = (size_t)num_rows * num_cols, page = sysconf(_SC_PAGESIZE), offset = 0;
+        auto region = [&](size_t bytes)
+        {
+            size_t start = offset;
+            offset += (std::max<size_t>(bytes, 1) + page - 1) / page * page;
+            return start;
+        };
+        size_t type_offset = region(cells * sizeof(entity_type_t)), energy_offset = region(cells * sizeof(int32_t));
+        size_t age_offset = region(cells * sizeof(int32_t)), acted_offset = region(cells * sizeof(uint8_t));
+        bool mapped = ftruncate(fd, offset) == 0 && type.map(fd, type_offset, cells) && energy.map(fd, energy_offset, cells) &&
+                      age.map(fd, age_offset, cells) && acted.map(fd, acted_offset, cells);
+        close(fd);
+        if (!mapped)
+            return false;
+        rows = num_rows;
+        cols = num_cols;
+        dirty.assign((cells + 63) / 64, 0);
+        stats = grid_stats_t();
+        stats.count[empty] = cells;
+        histograms.clear();
+        band_rows = std::max<uint32_t>(1, GRID_STREAM_BYTES / (num_cols * (sizeof(entity_type_t) + 2 * sizeof(int32_t) + sizeof(uint8_t))));
+        return true;
+    }
+
+    bool mapped() const { return type.mapped(); }
+
+    // Paging hints for a step about to process the band starting at `row`: the next band is read ahead, and the
+    // writeback of the band before the previous one starts, since the step can no longer modify it
+    void stream(uint32_t row) const
+    {
+        if (!mapped())
+            return;
+        size_t band = (size_t)band_rows * cols;
+        size_t next = (size_t)(row + band_rows) * cols;
+        type.advise(next, band, MADV_WILLNEED);
+        energy.advise(next, band, MADV_WILLNEED);
+        age.advise(next, band, MADV_WILLNEED);
+        acted.advise(next, band, MADV_WILLNEED);
+        if (row < 2 * band_rows)
+            return;
+        size_t done = (size_t)(row - 2 * band_rows) * cols;
+        type.flush(done, band);
+        energy.flush(done, band);
+        age.flush(done, band);
+        acted.flush(done, band);
+    }
+
+    uint32_t size() const { return rows * cols; }
+    uint32_t index(uint32_t i, uint32_t j) const { return i * cols + j; }
+
+    entity_t at(uint32_t idx) const { return {type[idx], energy[idx], age[idx]}; }
+
+    void mark(uint32_t idx) { dirty[idx >> 6] |= 1ull << (idx & 63); }
+
+    void set(uint32_t idx, const entity_t &e)
+    {
+        stats.remove(at(idx));
+        stats.add(e);
+        if (histograms.enabled)
+        {
+            histograms.remove(at(idx));
+            histograms.add(e);
+        }
+        type[idx] = e.type;
+        energy[idx] = e.energy;
+        age[idx] = e.age;
+        mark(idx);
+    }
+
+    void clear(uint32_t idx) { set(idx, {empty, 0, 0}); }
+
+    void set_energy(uint32_t idx, int32_t value)
+    {
+        stats.energy[type[idx]] += (int64_t)value - energy[idx];
+        if (histograms.enabled && type[idx] != empty)
+            histograms.energy[type[idx]].move(energy[idx], value);
+        energy[idx] = value;
+    }
+
+    // Ages the entity at `idx` by a step and returns its new age; the step adds the aged entities to the age
+    // totals once it is done
+    int32_t grow_older(uint32_t idx)
+    {
+        int32_t older = age[idx] + 1;
+        if (histograms.enabled)
+            histograms.age[type[idx]].move(age[idx], older);
+        age[idx] = older;
+        return older;
+    }
+
+    // Keeps histograms over the ranges of `rules` from now on. Returns whether the ranges changed, which leaves
+    // the histograms empty until recount() fills them, unless the grid is empty anyway.
+    bool track_histograms(const rule_set_t &rules)
+    {
+        grid_histograms_t tracked(rules);
+        if (tracked.same_ranges(histograms))
+            return false;
+        histograms = tracked;
+        return stats.count[empty] != size();
+    }
+
+    // Recomputes the stats and histograms from the fields; cells of an unknown type, only read from corrupt files,
+    // are cleared
+    void recount()
+    {
+        stats = grid_stats_t();
+        histograms.clear();
+        for (uint32_t idx = 0; idx < size(); idx++)
+        {
+            if (type[idx] > carnivore)
+                type[idx] = empty;
+            stats.add(at(idx));
+            if (histograms.enabled)
+                histograms.add(at(idx));
+        }
+    }
+
+    // Fills `out` with the (up to 4) orthogonal neighbours of `idx` and returns how many there are
+    uint32_t neighbours(uint32_t idx, uint32_t out[4]) const
+    {
+        uint32_t i = idx / cols, j = idx % cols, n = 0;
+        if (i > 0)
+            out[n++] = idx - cols;
+        if (i + 1 < rows)
+            out[n++] = idx + cols;
+        if (j > 0)
+            out[n++] = idx - 1;
+        if (j + 1 < cols)
+            out[n++] = idx + 1;
+        return n;
+    }
+};
+
+// A probability as a threshold on a 32-bit random draw: the event happens when the draw is below it.
+// Thresholds of 0 and 2^32 mean never and always, and take no draw at all.
+constexpr uint64_t probability_threshold(double probability)
+{
+    return probability <= 0 ? 0 : probability >= 1 ? (1ull << 32) : (uint64_t)(probability * 4294967296.0);
+}
+
+// Returns true with the probability given as a threshold
+inline bool random_action(uint64_t threshold, std::mt19937 &gen)
+{
+    if (threshold == 0)
+        return false;
+    if (threshold >= (1ull << 32))
+        return true;
+    return gen() < threshold;
+}
+
+// Whether an event never happens, always happens or takes a draw, the behaviour class of its probability
+enum draw_class_t : uint32_t
+{
+    draw_never,
+    draw_always,
+    draw_random
+};
+
+constexpr draw_class_t draw_class(uint64_t threshold)
+{
+    return threshold == 0 ? draw_never : threshold >= (1ull << 32) ? draw_always : draw_random;
+}
+
+// A threshold whose class is known at compile time, so only a drawn one is compared at run time
+template <draw_class_t kind>
+struct class_threshold_t
+{
+    uint64_t value;
+};
+
+template <draw_class_t kind>
+inline bool random_action(class_threshold_t<kind> threshold, std::mt19937 &gen)
+{
+    if constexpr (kind == draw_never)
+        return false;
+    else if constexpr (kind == draw_always)
+        return true;
+    else
+        return gen() < threshold.value;
+}
+
+// Uniform integer in [0, count) from a single draw
+inline uint32_t random_index(uint32_t count, std::mt19937 &gen)
+{
+    return (uint32_t)(((uint64_t)gen() * count) >> 32);
+}
+
+// The default rules as compile-time constants, so the kernel specialised on them folds every threshold
+struct default_rules_t
+{
+    static constexpr int32_t plant_maximum_age = DEFAULT_RULES.plant_maximum_age;
+    static constexpr int32_t herbivore_maximum_age = DEFAULT_RULES.herbivore_maximum_age;
+    static constexpr int32_t carnivore_maximum_age = DEFAULT_RULES.carnivore_maximum_age;
+    static constexpr int32_t maximum_energy = DEFAULT_RULES.maximum_energy;
+    static constexpr int32_t threshold_energy_for_reproduction = DEFAULT_RULES.threshold_energy_for_reproduction;
+    static constexpr int32_t initial_energy = DEFAULT_RULES.initial_energy;
+    static constexpr int32_t move_energy_cost = DEFAULT_RULES.move_energy_cost;
+    static constexpr int32_t reproduction_energy_cost = DEFAULT_RULES.reproduction_energy_cost;
+    static constexpr int32_t herbivore_eat_energy_gain = DEFAULT_RULES.herbivore_eat_energy_gain;
+    static constexpr int32_t carnivore_eat_energy_gain = DEFAULT_RULES.carnivore_eat_energy_gain;
+    static constexpr uint64_t plant_reproduction_threshold = probability_threshold(DEFAULT_RULES.plant_reproduction_probability);
+    static constexpr uint64_t herbivore_reproduction_threshold = probability_threshold(DEFAULT_RULES.herbivore_reproduction_probability);
+    static constexpr uint64_t carnivore_reproduction_threshold = probability_threshold(DEFAULT_RULES.carnivore_reproduction_probability);
+    static constexpr uint64_t herbivore_move_threshold = probability_threshold(DEFAULT_RULES.herbivore_move_probability);
+    static constexpr uint64_t herbivore_eat_threshold = probability_threshold(DEFAULT_RULES.herbivore_eat_probability);
+    static constexpr uint64_t carnivore_move_threshold = probability_threshold(DEFAULT_RULES.carnivore_move_probability);
+    static constexpr uint64_t carnivore_eat_threshold = probability_threshold(DEFAULT_RULES.carnivore_eat_probability);
+};
+
+// Behaviour class of a rule set: the draw class of each of its probabilities, two bits each in the order of
+// RULE_PARAMETERS. Rule sets of the same class take the same branches and draws, whatever their values.
+template <typename rules_t>
+constexpr uint32_t behaviour_class(const rules_t &rules)
+{
+    return draw_class(rules.plant_reproduction_threshold) | draw_class(rules.herbivore_reproduction_threshold) << 2 |
+           draw_class(rules.carnivore_reproduction_threshold) << 4 | draw_class(rules.herbivore_move_threshold) << 6 |
+           draw_class(rules.herbivore_eat_threshold) << 8 | draw_class(rules.carnivore_move_threshold) << 10 |
+           draw_class(rules.carnivore_eat_threshold) << 12;
+}
+
+constexpr draw_class_t class_of(uint32_t behaviour, uint32_t probability)
+{
+    return (draw_class_t)(behaviour >> (2 * probability) & 3);
+}
+
+// The behaviour classes with a kernel of their own: that of the default rules, and every probability drawn
+static constexpr uint32_t DEFAULT_BEHAVIOUR = behaviour_class(default_rules_t());
+static constexpr uint32_t RANDOM_BEHAVIOUR = 0x2aaa;
+
+// A rule set converted once to the integers the kernel compares against
+struct compiled_rules_t
+{
+    rule_set_t source;
+    // Set when the conversion is identical to the default rules', which then run on the kernel with every constant
+    // folded; other rule sets of a behaviour class with a kernel of its own run on it, with the values read at run time
+    bool is_default;
+    uint32_t behaviour;
+
+    int32_t plant_maximum_age;
+    int32_t herbivore_maximum_age;
+    int32_t carnivore_maximum_age;
+    int32_t maximum_energy;
+    int32_t threshold_energy_for_reproduction;
+    int32_t initial_energy;
+    int32_t move_energy_cost;
+    int32_t reproduction_energy_cost;
+    int32_t herbivore_eat_energy_gain;
+    int32_t carnivore_eat_energy_gain;
+    uint64_t plant_reproduction_threshold;
+    uint64_t herbivore_reproduction_threshold;
+    uint64_t carnivore_reproduction_threshold;
+    uint64_t herbivore_move_threshold;
+    uint64_t herbivore_eat_threshold;
+    uint64_t carnivore_move_threshold;
+    uint64_t carnivore_eat_threshold;
+
+    explicit compiled_rules_t(const rule_set_t &rules = DEFAULT_RULES)
+        : source(rules),
+          plant_maximum_age(rules.plant_maximum_age),
+          herbivore_maximum_age(rules.herbivore_maximum_age),
+          carnivore_maximum_age(rules.carnivore_maximum_age),
+          maximum_energy(rules.maximum_energy),
+          threshold_energy_for_reproduction(rules.threshold_energy_for_reproduction),
+          initial_energy(rules.initial_energy),
+          move_energy_cost(rules.move_energy_cost),
+          reproduction_energy_cost(rules.reproduction_energy_cost),
+          herbivore_eat_energy_gain(rules.herbivore_eat_energy_gain),
+          carnivore_eat_energy_gain(rules.carnivore_eat_energy_gain),
+          plant_reproduction_threshold(probability_threshold(rules.plant_reproduction_probability)),
+          herbivore_reproduction_threshold(probability_threshold(rules.herbivore_reproduction_probability)),
+          carnivore_reproduction_threshold(probability_threshold(rules.carnivore_reproduction_probability)),
+          herbivore_move_threshold(probability_threshold(rules.herbivore_move_probability)),
+          herbivore_eat_threshold(probability_threshold(rules.herbivore_eat_probability)),
+          carnivore_move_threshold(probability_threshold(rules.carnivore_move_probability)),
+          carnivore_eat_threshold(probability_threshold(rules.carnivore_eat_probability))
+    {
+        const default_rules_t d;
+        is_default = plant_maximum_age == d.plant_maximum_age &&
+                     herbivore_maximum_age == d.herbivore_maximum_age &&
+                     carnivore_maximum_age == d.carnivore_maximum_age &&
+                     maximum_energy == d.maximum_energy &&
+                     threshold_energy_for_reproduction == d.threshold_energy_for_reproduction &&
+                     initial_energy == d.initial_energy &&
+                     move_energy_cost == d.move_energy_cost &&
+                     reproduction_energy_cost == d.reproduction_energy_cost &&
+                     herbivore_eat_energy_gain == d.herbivore_eat_energy_gain &&
+                     carnivore_eat_energy_gain == d.carnivore_eat_energy_gain &&
+                     plant_reproduction_threshold == d.plant_reproduction_threshold &&
+                     herbivore_reproduction_threshold == d.herbivore_reproduction_threshold &&
+                     carnivore_reproduction_threshold == d.carnivore_reproduction_threshold &&
+                     herbivore_move_threshold == d.herbivore_move_threshold &&
+                     herbivore_eat_threshold == d.herbivore_eat_threshold &&
+                     carnivore_move_threshold == d.carnivore_move_threshold &&
+                     carnivore_eat_threshold == d.carnivore_eat_threshold;
+        behaviour = behaviour_class(*this);
+    }
+
+    // Whether the rules run on a specialised kernel rather than the generic one
+    bool specialized() const { return is_default || behaviour == DEFAULT_BEHAVIOUR || behaviour == RANDOM_BEHAVIOUR; }
+};
+
+// A rule set of a known behaviour class: the thresholds hide those of compiled_rules_t with ones whose class is a
+// template parameter, so the kernel drops the draws and branches of events that never or always happen
+template <uint32_t kernel_behaviour>
+struct class_rules_t : compiled_rules_t
+{
+    class_threshold_t<class_of(kernel_behaviour, 0)> plant_reproduction_threshold{compiled_rules_t::plant_reproduction_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 1)> herbivore_reproduction_threshold{compiled_rules_t::herbivore_reproduction_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 2)> carnivore_reproduction_threshold{compiled_rules_t::carnivore_reproduction_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 3)> herbivore_move_threshold{compiled_rules_t::herbivore_move_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 4)> herbivore_eat_threshold{compiled_rules_t::herbivore_eat_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 5)> carnivore_move_threshold{compiled_rules_t::carnivore_move_threshold};
+    class_threshold_t<class_of(kernel_behaviour, 6)> carnivore_eat_threshold{compiled_rules_t::carnivore_eat_threshold};
+
+    explicit class_rules_t(const compiled_rules_t &rules) : compiled_rules_t(rules) {}
+};
+
+// Number of entities of each species in a grid
+struct population_t
+{
+    uint32_t plants = 0;
+    uint32_t herbivores = 0;
+    uint32_t carnivores = 0;
+
+    uint32_t total() const { return plants + herbivores + carnivores; }
+};
+
+inline population_t count_population(const grid_t &grid)
+{
+    return {(uint32_t)grid.stats.count[plant], (uint32_t)grid.stats.count[herbivore], (uint32_t)grid.stats.count[carnivore]};
+}
+
+// Per-block aggregates of a grid downsampled to blocks of `block` x `block` cells, row-major by block; the blocks on
+// the bottom and right edges cover what is left of the grid
+struct density_map_t
+{
+    uint32_t block = 1;
+    uint32_t rows = 0; // Blocks down
+    uint32_t cols = 0; // Blocks across
+    std::vector<uint32_t> plants;
+    std::vector<uint32_t> herbivores;
+    std::vector<uint32_t> carnivores;
+    std::vector<int64_t> energy; // Total energy of the entities of each block
+
+    double mean_energy(uint32_t b) const
+    {
+        uint32_t entities = plants[b] + herbivores[b] + carnivores[b];
+        return entities ? (double)energy[b] / entities : 0;
+    }
+};
+
+// Reads the grid once, a row at a time, folding the cells of each block's slice of the row with branchless
+// comparisons the compiler vectorizes
+inline density_map_t density_map(const grid_t &grid, uint32_t block)
+{
+    // A block larger than the grid covers all of it, and keeps the block arithmetic below from overflowing
+    block = std::max(1u, std::min(block, std::max(grid.rows, grid.cols)));
+    density_map_t map;
+    map.block = block;
+    map.rows = (uint32_t)(((uint64_t)grid.rows + block - 1) / block);
+    map.cols = (uint32_t)(((uint64_t)grid.cols + block - 1) / block);
+    size_t blocks = (size_t)map.rows * map.cols;
+    map.plants.assign(blocks, 0);
+    map.herbivores.assign(blocks, 0);
+    map.carnivores.assign(blocks, 0);
+    map.energy.assign(blocks, 0);
+    for (uint32_t row = 0; row < grid.rows; row++)
+    {
+        const entity_type_t *type = &grid.type[(size_t)row * grid.cols];
+        const int32_t *energy = &grid.energy[(size_t)row * grid.cols];
+        size_t b = (size_t)(row / block) * map.cols;
+        for (uint32_t first = 0; first < grid.cols; first += block, b++)
+        {
+            uint32_t last = std::min(grid.cols, first + block), plants = 0, herbivores = 0, carnivores = 0;
+            int64_t total = 0;
+            for (uint32_t col = first; col < last; col++)
+            {
+                plants += type[col] == plant;
+                herbivores += type[col] == herbivore;
+                carnivores += type[col] == carnivore;
+                total += type[col] != empty ? energy[col] : 0;
+            }
+            map.plants[b] += plants;
+            map.herbivores[b] += herbivores;
+            map.carnivores[b] += carnivores;
+            map.energy[b] += total;
+        }
+    }
+    return map;
+}
+
+// Picks a random neighbour of `idx` holding an entity of type `wanted`, or NO_CELL if there is none
+inline uint32_t random_neighbour(const grid_t &grid, uint32_t idx, entity_type_t wanted, std::mt19937 &gen)
+{
+    uint32_t candidates[4], neighbours[4];
+    uint32_t count = 0, n = grid.neighbours(idx, neighbours);
+    for (uint32_t k = 0; k < n; k++)
+        if (grid.type[neighbours[k]] == wanted)
+            candidates[count++] = neighbours[k];
+    if (count == 0)
+        return NO_CELL;
+    return candidates[random_index(count, gen)];
+}
+
+// Places the initial entities at random empty cells
+inline void populate_grid(grid_t &grid, const rule_set_t &rules, uint32_t plants, uint32_t herbivores, uint32_t carnivores, std::mt19937 &gen)
+{
+    const uint32_t total = plants + herbivores + carnivores;
+    std::vector<uint32_t> cells;
+    if (total * 2 > grid.size())
+    {
+        // Dense start: shuffle every cell index once instead of retrying collisions
+        cells.resize(grid.size());
+        for (uint32_t idx = 0; idx < grid.size(); idx++)
+            cells[idx] = idx;
+        std::shuffle(cells.begin(), cells.end(), gen);
+        cells.resize(total);
+    }
+    else
+    {
+        std::vector<uint8_t> taken(grid.size(), 0);
+        while (cells.size() < total)
+        {
+            uint32_t idx = random_index(grid.size(), gen);
+            if (!taken[idx])
+            {
+                taken[idx] = 1;
+                cells.push_back(idx);
+            }
+        }
+    }
+
+    for (uint32_t k = 0; k < total; k++)
+    {
+        if (k < plants)
+            grid.set(cells[k], {plant, 0, 0});
+        else if (k < plants + herbivores)
+            grid.set(cells[k], {herbivore, (int32_t)rules.initial_energy, 0});
+        else
+            grid.set(cells[k], {carnivore, (int32_t)rules.initial_energy, 0});
+    }
+}
+
+// Energy in 64 bits, as after adding a gain or cost of up to INT32_MAX, brought back into [0, maximum]
+inline int32_t clamp_energy(int64_t energy, int32_t maximum)
+{
+    return (int32_t)std::min<int64_t>(std::max<int64_t>(energy, 0), maximum);
+}
+
+// The rule of the species `self`, of either type
+template <entity_type_t self, typename herbivore_t, typename carnivore_t>
+constexpr auto species_rule(herbivore_t herbivore_rule, carnivore_t carnivore_rule)
+{
+    if constexpr (self == herbivore)
+        return herbivore_rule;
+    else
+        return carnivore_rule;
+}
+
+// Simulates one time step of an animal at `idx`: eat, move, reproduce and starve
+template <entity_type_t self, typename rules_t>
+inline void simulate_animal(grid_t &grid, uint32_t idx, const rules_t &rules, std::mt19937 &gen)
+{
+    const entity_type_t prey = self == herbivore ? plant : herbivore;
+    const auto eat_threshold = species_rule<self>(rules.herbivore_eat_threshold, rules.carnivore_eat_threshold);
+    const int32_t eat_gain = self == herbivore ? rules.herbivore_eat_energy_gain : rules.carnivore_eat_energy_gain;
+    const auto move_threshold = species_rule<self>(rules.herbivore_move_threshold, rules.carnivore_move_threshold);
+    const auto reproduction_threshold = species_rule<self>(rules.herbivore_reproduction_threshold, rules.carnivore_reproduction_threshold);
+
+    // Eat an adjacent prey, which leaves its cell empty
+    uint32_t target = random_neighbour(grid, idx, prey, gen);
+    if (target != NO_CELL && random_action(eat_threshold, gen))
+    {
+        grid.clear(target);
+        grid.set_energy(idx, clamp_energy((int64_t)grid.energy[idx] + eat_gain, rules.maximum_energy));
+    }
+
+    // Move to an adjacent empty cell
+    if (random_action(move_threshold, gen))
+    {
+        target = random_neighbour(grid, idx, empty, gen);
+        if (target != NO_CELL)
+        {
+            grid.set(target, grid.at(idx));
+            grid.set_energy(target, clamp_energy((int64_t)grid.energy[target] - rules.move_energy_cost, rules.maximum_energy));
+            grid.acted[target] = 1;
+            grid.clear(idx);
+            idx = target;
+        }
+    }
+
+    // Reproduce into an adjacent empty cell
+    if (grid.energy[idx] > rules.threshold_energy_for_reproduction && random_action(reproduction_threshold, gen))
+    {
+        target = random_neighbour(grid, idx, empty, gen);
+        if (target != NO_CELL)
+        {
+            grid.set(target, {self, rules.initial_energy, 0});
+            grid.acted[target] = 1;
+            grid.set_energy(idx, grid.energy[idx] - rules.reproduction_energy_cost);
+        }
+    }
+
+    if (grid.energy[idx] <= 0)
+        grid.clear(idx);
+}
+
+// Advances the whole grid by one time step under the given rules
+template <typename rules_t>
+inline void simulate_step_kernel(grid_t &grid, const rules_t &rules, std::mt19937 &gen)
+{
+    std::fill(grid.acted.begin(), grid.acted.end(), 0);
+    // Entities of each type aged by the step, added to the age totals once at the end
+    int64_t aged[4] = {};
+
+    // Row-major order is the order the fields are stored in, so a step streams through them front to back
+    for (uint32_t row = 0; row < grid.rows; row += grid.band_rows)
+    {
+        grid.stream(row);
+        const uint32_t band_end = std::min(grid.rows, row + grid.band_rows) * grid.cols;
+        for (uint32_t idx = row * grid.cols; idx < band_end; idx++)
+        {
+            if (grid.type[idx] == empty || grid.acted[idx])
+                continue;
+            grid.acted[idx] = 1;
+            // Every entity visited ages; the other cells it writes to go through set()
+            grid.mark(idx);
+            aged[grid.type[idx]]++;
+
+            switch (grid.type[idx])
+            {
+            case plant:
+                if (grid.grow_older(idx) >= rules.plant_maximum_age)
+                {
+                    grid.clear(idx);
+                }
+                else if (random_action(rules.plant_reproduction_threshold, gen))
+                {
+                    uint32_t target = random_neighbour(grid, idx, empty, gen);
+                    if (target != NO_CELL)
+                    {
+                        grid.set(target, {plant, 0, 0});
+                        grid.acted[target] = 1;
+                    }
+                }
+                break;
+
+            case herbivore:
+                if (grid.grow_older(idx) >= rules.herbivore_maximum_age)
+                    grid.clear(idx);
+                else
+                    simulate_animal<herbivore>(grid, idx, rules, gen);
+                break;
+
+            case carnivore:
+                if (grid.grow_older(idx) >= rules.carnivore_maximum_age)
+                    grid.clear(idx);
+                else
+                    simulate_animal<carnivore>(grid, idx, rules, gen);
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+    for (int type = plant; type <= carnivore; type++)
+        grid.stats.age[type] += aged[type];
+}
+
+// Advances the whole grid by one time step, on the constant-folded kernel whenever the rules are the default ones,
+// on the kernel of their behaviour class when it has one, and on the generic kernel otherwise
+inline void simulate_step(grid_t &grid, const compiled_rules_t &rules, std::mt19937 &gen)
+{
+    if (rules.is_default)
+        simulate_step_kernel(grid, default_rules_t(), gen);
+    else if (rules.behaviour == DEFAULT_BEHAVIOUR)
+        simulate_step_kernel(grid, class_rules_t<DEFAULT_BEHAVIOUR>(rules), gen);
+    else if (rules.behaviour == RANDOM_BEHAVIOUR)
+        simulate_step_kernel(grid, class_rules_t<RANDOM_BEHAVIOUR>(rules), gen);
+    else
+        simulate_step_kernel(grid, rules, gen);
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Items kept by the top level of a quantile sketch; ranks are within about 1.7% of the truth at this size
+static const uint32_t KLL_K = 200;
+static const uint32_t KLL_MINIMUM_CAPACITY = 8;
+
+// Mergeable quantile sketch of integer values (KLL, Karnin, Lang & Liberty 2016). An item of level h stands for
+// 2^h values; a level that outgrows its capacity is sorted and every other item, from a random start, moves up
+// a level. Lower levels get geometrically smaller capacities, so the sketch stays at about 3 * KLL_K items
+// however many values it has seen, and merging two sketches is concatenating their levels and compacting.
+class kll_sketch_t
+{
+public:
+    void add(int32_t value)
+    {
+        if (levels.empty())
+            levels.emplace_back();
+        levels[0].push_back(value);
+        count++;
+        if (levels[0].size() >= first_capacity)
+            compact();
+    }
+
+    void merge(const kll_sketch_t &other)
+    {
+        if (levels.size() < other.levels.size())
+            levels.resize(other.levels.size());
+        for (size_t h = 0; h < other.levels.size(); h++)
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        count += other.count;
+        compact();
+    }
+
+    uint64_t size() const { return count; }
+
+    // Value at rank `q` (0 to 1) of the values seen, 0 if there are none
+    int32_t quantile(double q) const
+    {
+        std::vector<std::pair<int32_t, uint64_t>> weighted;
+        uint64_t total = 0;
+        for (size_t h = 0; h < levels.size(); h++)
+            for (int32_t value : levels[h])
+            {
+                weighted.emplace_back(value, 1ull << h);
+                total += 1ull << h;
+            }
+        if (weighted.empty())
+            return 0;
+        std::sort(weighted.begin(), weighted.end());
+        double rank = q * total;
+        uint64_t seen = 0;
+        for (auto &item : weighted)
+        {
+            seen += item.second;
+            if (seen >= rank)
+                return item.first;
+        }
+        return weighted.back().first;
+    }
+
+private:
+    uint32_t capacity(size_t h) const
+    {
+        return std::max(KLL_MINIMUM_CAPACITY, (uint32_t)std::ceil(KLL_K * std::pow(2.0 / 3.0, (double)(levels.size() - 1 - h))));
+    }
+
+    void compact()
+    {
+        for (size_t h = 0; h < levels.size(); h++)
+        {
+            if (levels[h].size() < capacity(h))
+                continue;
+            if (h + 1 == levels.size())
+                levels.emplace_back();
+            std::vector<int32_t> &level = levels[h];
+            std::sort(level.begin(), level.end());
+            // An odd item out stays behind, so the promoted pairs keep the total weight
+            size_t pairs = level.size() / 2, start = coin();
+            for (size_t k = 0; k < pairs; k++)
+                levels[h + 1].push_back(level[2 * k + start]);
+            int32_t left = level.back();
+            bool odd = level.size() % 2 == 1;
+            level.clear();
+            if (odd)
+                level.push_back(left);
+        }
+        first_capacity = capacity(0);
+    }
+
+    // Deterministic coin flips (xorshift), so that the same values always give the same sketch
+    size_t coin()
+    {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        return random & 1;
+    }
+
+    std::vector<std::vector<int32_t>> levels;
+    uint64_t count = 0;
+    uint32_t first_capacity = 0; // Of level 0, the only one adding a value can fill
+    uint64_t random = 0x9E3779B97F4A7C15ull;
+};
+
+// Distribution of one field over the entities of one species
+struct distribution_t
+{
+    kll_sketch_t sketch;
+    fixed_histogram_t histogram;
+    bool histogram_complete = true; // Cleared once a histogram could not be merged in, so it misses values the sketch has
+
+    void add(int32_t value)
+    {
+        sketch.add(value);
+        histogram.add(value);
+    }
+
+    // The sketches merge regardless; histograms of different ranges clear histogram_complete
+    void merge(const distribution_t &other)
+    {
+        sketch.merge(other.sketch);
+        bool merged = histogram.merge(other.histogram);
+        histogram_complete = histogram_complete && other.histogram_complete && merged;
+    }
+};
+
+// Energy and age distributions of each species of a grid, by entity_type_t (empty unused). The histograms have the
+// ranges of grid_histograms_t, so only grids simulated under the same limits have mergeable histograms; the
+// sketches merge regardless.
+struct grid_distributions_t
+{
+    std::array<distribution_t, 4> energy;
+    std::array<distribution_t, 4> age;
+
+    grid_distributions_t() = default;
+    explicit grid_distributions_t(const rule_set_t &rules) { set_histograms(grid_histograms_t(rules)); }
+
+    // Distributions of a grid that tracks its histograms: those are taken as the step keeps them, and only the
+    // sketches need a pass over the fields
+    explicit grid_distributions_t(const grid_t &grid)
+    {
+        set_histograms(grid.histograms);
+        for (uint32_t idx = 0; idx < grid.size(); idx++)
+            if (grid.type[idx] != empty)
+            {
+                energy[grid.type[idx]].sketch.add(grid.energy[idx]);
+                age[grid.type[idx]].sketch.add(grid.age[idx]);
+            }
+    }
+
+    void add(const entity_t &e)
+    {
+        energy[e.type].add(e.energy);
+        age[e.type].add(e.age);
+    }
+
+    // Adds every entity of the grid, in one pass over the fields
+    void add(const grid_t &grid)
+    {
+        for (uint32_t idx = 0; idx < grid.size(); idx++)
+            if (grid.type[idx] != empty)
+                add(grid.at(idx));
+    }
+
+    // Histograms that could not be merged are marked incomplete, and left out of what is reported
+    void merge(const grid_distributions_t &other)
+    {
+        for (int type = plant; type <= carnivore; type++)
+        {
+            energy[type].merge(other.energy[type]);
+            age[type].merge(other.age[type]);
+        }
+    }
+
+private:
+    void set_histograms(const grid_histograms_t &histograms)
+    {
+        for (int type = plant; type <= carnivore; type++)
+        {
+            energy[type].histogram = histograms.energy[type];
+            age[type].histogram = histograms.age[type];
+        }
+    }
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "ensemble.h"
+
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+// Rule parameters overridden by one point of a sweep
+using sweep_configuration_t = std::vector<std::pair<const rule_parameter_t *, double>>;
+
+// Every combination of the given values of each parameter
+inline std::vector<sweep_configuration_t> grid_configurations(const std::vector<std::pair<const rule_parameter_t *, std::vector<double>>> &axes)
+{
+    std::vector<sweep_configuration_t> configurations(1);
+    for (auto &axis : axes)
+    {
+        std::vector<sweep_configuration_t> product;
+        for (auto &configuration : configurations)
+            for (double value : axis.second)
+            {
+                product.push_back(configuration);
+                product.back().emplace_back(axis.first, value);
+            }
+        configurations = std::move(product);
+    }
+    return configurations;
+}
+
+// `samples` Latin hypercube points: each parameter's [min, max] range is cut into `samples` strata,
+// every stratum is used exactly once, and strata are paired across parameters at random
+inline std::vector<sweep_configuration_t> latin_hypercube_configurations(const std::vector<std::pair<const rule_parameter_t *, std::pair<double, double>>> &ranges,
+                                                                         uint32_t samples, std::mt19937 &gen)
+{
+    std::vector<sweep_configuration_t> configurations(samples);
+    std::uniform_real_distribution<> offset(0.0, 1.0);
+    std::vector<uint32_t> strata(samples);
+    for (auto &range : ranges)
+    {
+        std::iota(strata.begin(), strata.end(), 0);
+        std::shuffle(strata.begin(), strata.end(), gen);
+        double width = (range.second.second - range.second.first) / samples;
+        for (uint32_t k = 0; k < samples; k++)
+            configurations[k].emplace_back(range.first, range.second.first + (strata[k] + offset(gen)) * width);
+    }
+    return configurations;
+}
+
+// A sweep job: every configuration times `replicas` replicas, run in slices as background tasks on the scheduler.
+// A configuration's summary becomes available as soon as its last replica finishes. Summaries are allocated as the
+// first replica of their configuration finishes, so a sweep holds memory for the configurations run so far only.
+class sweep_t : public std::enable_shared_from_this<sweep_t>
+{
+public:
+    sweep_t(const ensemble_config_t &base, std::vector<sweep_configuration_t> configurations, uint32_t replicas, uint32_t seed)
+        : base(base), configurations(std::move(configurations)), replicas(replicas), seed(seed),
+          stats(this->configurations.size())
+    {
+    }
+
+    void start(scheduler_t &scheduler)
+    {
+        auto self = shared_from_this();
+        for (uint32_t c = 0; c < configurations.size(); c++)
+            for (uint32_t r = 0; r < replicas; r++)
+                scheduler.submit_sliced([self, c, r, replica = std::shared_ptr<replica_t>()]() mutable
+                                        { return self->run(c, r, replica); },
+                                        [self, c]
+                                        { self->fail(c); });
+    }
+
+    void cancel() { cancelled = true; }
+
+    const sweep_configuration_t &configuration(uint32_t c) const { return configurations[c]; }
+    size_t size() const { return configurations.size(); }
+
+    // Configurations finished since the `from`-th one, in completion order, with their final-step statistics
+    std::vector<std::pair<uint32_t, ensemble_stats_t>> results(size_t from, bool &done)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<uint32_t, ensemble_stats_t>> out;
+        for (size_t k = from; k < completed.size(); k++)
+            out.emplace_back(completed[k], *stats[completed[k]]);
+        done = completed.size() == configurations.size() || cancelled;
+        return out;
+    }
+
+    // Whether every configuration finished before `time`
+    bool finished_before(steady_clock_t::time_point time)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return completed.size() == configurations.size() && finished < time;
+    }
+
+private:
+    // Runs the next slice of replica r of configuration c, started on the first call; returns true once it is done
+    bool run(uint32_t c, uint32_t r, std::shared_ptr<replica_t> &replica)
+    {
+        if (cancelled)
+            return true;
+        if (!replica)
+        {
+            ensemble_config_t config = base;
+            for (auto &parameter : configurations[c])
+                set_rule_parameter(config.rules, *parameter.first, parameter.second);
+            std::seed_seq seq{seed, c, r};
+            replica = std::make_shared<replica_t>(config, std::mt19937(seq));
+        }
+        if (!replica->run_slice())
+            return false;
+
+        // Only the final step is summarised per configuration
+        std::lock_guard<std::mutex> lock(mutex);
+        summary(c).add({replica->result().back()});
+        finish(c);
+        return true;
+    }
+
+    void fail(uint32_t c)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        summary(c).failed++;
+        finish(c);
+    }
+
+    // Summary of configuration c, allocated on first use; mutex must be held
+    ensemble_stats_t &summary(uint32_t c)
+    {
+        if (!stats[c])
+            stats[c] = std::make_unique<ensemble_stats_t>(0);
+        return *stats[c];
+    }
+
+    // Completes configuration c once each of its replicas has finished or failed
+    void finish(uint32_t c)
+    {
+        if (stats[c]->replicas + stats[c]->failed < replicas)
+            return;
+        completed.push_back(c);
+        if (completed.size() == configurations.size())
+            finished = steady_clock_t::now();
+    }
+
+    const ensemble_config_t base;
+    const std::vector<sweep_configuration_t> configurations;
+    const uint32_t replicas;
+    const uint32_t seed;
+    std::atomic<bool> cancelled{false};
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ensemble_stats_t>> stats;
+    std::vector<uint32_t> completed;
+    steady_clock_t::time_point finished; // When the last configuration completed
+};
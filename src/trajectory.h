@@ -0,0 +1,446 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Trajectory files, written by trajectory_recorder_t (native byte order):
+//   <name>.traj: header (magic, version, rows, cols, keyframe interval), then one frame per captured step:
+//     keyframe: step, then the type, energy and age arrays of the whole grid
+//     delta:    step, number of changed cells, then per cell its index, type, energy and age (packed)
+//   <name>.tidx: one trajectory_index_entry_t per frame, appended once the frame itself is on disk
+static const char TRAJECTORY_MAGIC[8] = {'E', 'C', 'O', 'S', 'I', 'M', 'T', 'R'};
+static const uint32_t TRAJECTORY_VERSION = 1;
+static const uint32_t TRAJECTORY_HEADER_BYTES = sizeof(TRAJECTORY_MAGIC) + 4 * sizeof(uint32_t);
+static const uint32_t TRAJECTORY_DELTA_BYTES = sizeof(uint32_t) + sizeof(entity_type_t) + 2 * sizeof(int32_t);
+
+struct trajectory_index_entry_t
+{
+    uint64_t step;
+    uint64_t offset; // Of the frame in the .traj file
+    uint64_t bytes;
+    uint64_t keyframe;
+};
+
+// `file`, after removing any file of that name. Rewriting a trajectory in place would truncate files that
+// readers have mapped; removed, they keep their contents until the last reader unmaps them.
+inline std::string fresh_file(const std::string &file)
+{
+    ::unlink(file.c_str());
+    return file;
+}
+
+// Bytes a recorder may hold before its writer takes them. Frames captured while the buffer is over it are dropped,
+// so that a disk slower than the session costs frames rather than memory, and the deltas start over from a keyframe
+// once the writer has caught up.
+static const size_t TRAJECTORY_BUFFER_BYTES = 256 << 20;
+
+// Records every step of a session into a trajectory. The step thread encodes each frame into a buffer, a delta
+// holding the cells the grid marked dirty since the previous frame; a writer thread swaps that buffer with a
+// second one and writes it out, so a step never waits for the disk, only for the buffer lock. Keyframes of mapped
+// grids, too large for the buffer, are the exception: they are written straight from the grid's fields.
+// Once a write fails the trajectory ends there, and the frames still captured count as failed.
+class trajectory_recorder_t
+{
+public:
+    trajectory_recorder_t(const std::string &path, uint32_t keyframe_interval)
+        : data(fresh_file(path + ".traj"), std::ios::binary | std::ios::trunc), index(fresh_file(path + ".tidx"), std::ios::binary | std::ios::trunc),
+          keyframe_interval(std::max(1u, keyframe_interval))
+    {
+    }
+
+    ~trajectory_recorder_t() { close(); }
+
+    bool is_open() const { return data.is_open() && index.is_open(); }
+
+    // Records the grid as the frame of `step`; the first frame, and every keyframe_interval-th after it, is a keyframe,
+    // as is the first frame after a dropped one. The grid's dirty bits must cover every cell written since the
+    // previous capture, as they do when it is called after each step and before the bits are cleared.
+    void capture(const grid_t &grid, uint64_t step)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (write_failed)
+        {
+            failed_frames++;
+            return;
+        }
+        if (frames > 0 && front.size() >= TRAJECTORY_BUFFER_BYTES)
+        {
+            dropped++;
+            until_keyframe = 0;
+            return;
+        }
+        bool keyframe = until_keyframe == 0;
+        until_keyframe = keyframe ? keyframe_interval - 1 : until_keyframe - 1;
+        if (frames == 0)
+        {
+            append(TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+            append(TRAJECTORY_VERSION);
+            append(grid.rows);
+            append(grid.cols);
+            append(keyframe_interval);
+            offset = front.size();
+            writer = std::thread([this]
+                                 { writer_loop(); });
+        }
+
+        if (keyframe && grid.mapped())
+        {
+            write_keyframe(lock, grid, step);
+            return;
+        }
+
+        size_t start = front.size();
+        append(step);
+        if (keyframe)
+        {
+            append(grid.type.data(), grid.size() * sizeof(entity_type_t));
+            append(grid.energy.data(), grid.size() * sizeof(int32_t));
+            append(grid.age.data(), grid.size() * sizeof(int32_t));
+        }
+        else
+        {
+            size_t count_at = front.size();
+            uint32_t count = 0;
+            append(count);
+            for (size_t w = 0; w < grid.dirty.size(); w++)
+                for (uint64_t bits = grid.dirty[w]; bits; bits &= bits - 1)
+                {
+                    uint32_t idx = w * 64 + __builtin_ctzll(bits);
+                    append(idx);
+                    append(grid.type[idx]);
+                    append(grid.energy[idx]);
+                    append(grid.age[idx]);
+                    count++;
+                }
+            std::memcpy(&front[count_at], &count, sizeof(count));
+        }
+
+        uint64_t bytes = front.size() - start;
+        front_index.push_back({step, offset, bytes, keyframe});
+        offset += bytes;
+        frames++;
+        pending.notify_one();
+    }
+
+    // Writes out what is still buffered and stops the writer
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        pending.notify_one();
+        if (writer.joinable())
+            writer.join();
+    }
+
+    uint32_t interval() const { return keyframe_interval; }
+
+    // Frames captured, dropped and lost to a failed write, bytes written to the .traj file so far and bytes still
+    // buffered
+    void stats(uint64_t &captured, uint64_t &lost, uint64_t &failed, uint64_t &written, uint64_t &buffered)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        captured = frames;
+        lost = dropped;
+        failed = failed_frames;
+        written = written_bytes;
+        buffered = front.size();
+    }
+
+private:
+    template <typename T>
+    void append(const T &value) { append(&value, sizeof(value)); }
+
+    void append(const void *bytes, size_t size)
+    {
+        const uint8_t *p = (const uint8_t *)bytes;
+        front.insert(front.end(), p, p + size);
+    }
+
+    // Writes a keyframe of a mapped grid straight from its fields, once the writer has written out everything
+    // before it, rather than copying a grid larger than memory into the buffer
+    void write_keyframe(std::unique_lock<std::mutex> &lock, const grid_t &grid, uint64_t step)
+    {
+        pending.notify_one();
+        drained.wait(lock, [&]
+                     { return front.empty() && !writing; });
+        uint64_t bytes = sizeof(step) + (uint64_t)grid.size() * (sizeof(entity_type_t) + 2 * sizeof(int32_t));
+        trajectory_index_entry_t entry = {step, offset, bytes, true};
+        if (!write_failed)
+        {
+            data.write((const char *)&step, sizeof(step));
+            data.write((const char *)grid.type.data(), grid.size() * sizeof(entity_type_t));
+            data.write((const char *)grid.energy.data(), grid.size() * sizeof(int32_t));
+            data.write((const char *)grid.age.data(), grid.size() * sizeof(int32_t));
+            data.flush();
+            if (data)
+            {
+                index.write((const char *)&entry, sizeof(entry));
+                index.flush();
+            }
+            write_failed = !data || !index;
+        }
+        if (write_failed)
+        {
+            failed_frames++;
+            return;
+        }
+        offset += bytes;
+        written_bytes += bytes;
+        frames++;
+    }
+
+    void writer_loop()
+    {
+        std::vector<uint8_t> back;
+        std::vector<trajectory_index_entry_t> back_index;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            pending.wait(lock, [&]
+                         { return stopping || !front.empty(); });
+            if (front.empty() && stopping)
+                break;
+            std::swap(front, back);
+            std::swap(front_index, back_index);
+            bool failed = write_failed;
+            writing = true;
+            lock.unlock();
+
+            // The frames go out before the index entries pointing at them, and after a failed write neither does,
+            // so readers only ever see the frames before it
+            if (!failed)
+            {
+                data.write((const char *)back.data(), back.size());
+                data.flush();
+                if (data)
+                {
+                    index.write((const char *)back_index.data(), back_index.size() * sizeof(trajectory_index_entry_t));
+                    index.flush();
+                }
+                failed = !data || !index;
+            }
+            size_t bytes = back.size(), lost = back_index.size();
+            back.clear();
+            back_index.clear();
+
+            lock.lock();
+            writing = false;
+            if (failed)
+            {
+                write_failed = true;
+                failed_frames += lost;
+            }
+            else
+                written_bytes += bytes;
+            drained.notify_all();
+        }
+    }
+
+    std::ofstream data;
+    std::ofstream index;
+    const uint32_t keyframe_interval;
+    std::thread writer;
+
+    // Guards everything below, shared by the step thread and the writer
+    std::mutex mutex;
+    std::condition_variable pending;
+    std::condition_variable drained; // Signalled each time the writer is done with a buffer
+    bool stopping = false;
+    bool writing = false;      // The writer is writing out a buffer, without the lock
+    bool write_failed = false; // A write failed, which ends the trajectory
+    std::vector<uint8_t> front;
+    std::vector<trajectory_index_entry_t> front_index;
+    uint64_t frames = 0;
+    uint64_t dropped = 0;
+    uint64_t failed_frames = 0;
+    uint32_t until_keyframe = 0; // Frames still to capture before the next keyframe
+    uint64_t offset = 0;
+    uint64_t written_bytes = 0;
+};
+
+// Read-only view of a recorded trajectory. The frames stay in the memory-mapped .traj file and are decoded
+// straight from it; only the index is read into memory.
+class trajectory_reader_t
+{
+public:
+    trajectory_reader_t() = default;
+    trajectory_reader_t(const trajectory_reader_t &) = delete;
+    trajectory_reader_t &operator=(const trajectory_reader_t &) = delete;
+
+    ~trajectory_reader_t()
+    {
+        if (mapped)
+            munmap((void *)mapped, mapped_size);
+    }
+
+    // Opens `path`.traj and `path`.tidx; frames whose index entry is missing, as while still recording, are left out
+    bool open(const std::string &path)
+    {
+        std::ifstream index_file(path + ".tidx", std::ios::binary);
+        trajectory_index_entry_t entry;
+        while (index_file.read((char *)&entry, sizeof(entry)))
+            index.push_back(entry);
+
+        int fd = ::open((path + ".traj").c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat status;
+        if (fstat(fd, &status) == 0 && status.st_size >= (off_t)TRAJECTORY_HEADER_BYTES)
+        {
+            mapped_size = status.st_size;
+            void *data = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+            mapped = data == MAP_FAILED ? nullptr : (const uint8_t *)data;
+        }
+        ::close(fd);
+        if (!mapped)
+            return false;
+
+        uint32_t version;
+        std::memcpy(&version, mapped + sizeof(TRAJECTORY_MAGIC), sizeof(version));
+        std::memcpy(&rows, mapped + sizeof(TRAJECTORY_MAGIC) + 4, sizeof(rows));
+        std::memcpy(&cols, mapped + sizeof(TRAJECTORY_MAGIC) + 8, sizeof(cols));
+        std::memcpy(&keyframe_interval, mapped + sizeof(TRAJECTORY_MAGIC) + 12, sizeof(keyframe_interval));
+        if (std::memcmp(mapped, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0 || version != TRAJECTORY_VERSION ||
+            rows == 0 || cols == 0 || (uint64_t)rows * cols >= NO_CELL)
+            return false;
+
+        // Only keep the frames that are complete and well formed, and start at a keyframe
+        uint64_t cells = (uint64_t)rows * cols;
+        for (size_t f = 0; f < index.size(); f++)
+        {
+            const trajectory_index_entry_t &e = index[f];
+            bool valid = e.offset >= TRAJECTORY_HEADER_BYTES && e.offset + e.bytes <= mapped_size && e.bytes >= sizeof(uint64_t) + sizeof(uint32_t) &&
+                         (f == 0 ? e.keyframe : e.step > index[f - 1].step);
+            if (valid && e.keyframe)
+                valid = e.bytes == sizeof(uint64_t) + cells * (sizeof(entity_type_t) + 2 * sizeof(int32_t));
+            else if (valid)
+            {
+                uint32_t count;
+                std::memcpy(&count, mapped + e.offset + sizeof(uint64_t), sizeof(count));
+                valid = e.bytes == sizeof(uint64_t) + sizeof(uint32_t) + (uint64_t)count * TRAJECTORY_DELTA_BYTES;
+            }
+            if (!valid)
+            {
+                index.resize(f);
+                break;
+            }
+        }
+        return !index.empty();
+    }
+
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint32_t keyframe_interval = 0;
+
+    size_t frames() const { return index.size(); }
+    const trajectory_index_entry_t &frame(size_t f) const { return index[f]; }
+
+    // Last frame recorded at or before `step`, or frames() if `step` comes before the first one
+    size_t find(uint64_t step) const
+    {
+        auto it = std::upper_bound(index.begin(), index.end(), step, [](uint64_t s, const trajectory_index_entry_t &e)
+                                   { return s < e.step; });
+        return it == index.begin() ? index.size() : it - index.begin() - 1;
+    }
+
+    // Nearest keyframe at or before frame `f`
+    size_t keyframe(size_t f) const
+    {
+        while (!index[f].keyframe)
+            f--;
+        return f;
+    }
+
+    // Applies frame `f` to a grid holding the frame before it (any grid of the right size, for a keyframe)
+    void apply(size_t f, grid_t &grid) const
+    {
+        const uint8_t *p = mapped + index[f].offset + sizeof(uint64_t);
+        uint32_t cells = grid.size();
+        if (index[f].keyframe)
+        {
+            std::memcpy(grid.type.data(), p, cells * sizeof(entity_type_t));
+            std::memcpy(grid.energy.data(), p + cells * sizeof(entity_type_t), cells * sizeof(int32_t));
+            std::memcpy(grid.age.data(), p + cells * (sizeof(entity_type_t) + sizeof(int32_t)), cells * sizeof(int32_t));
+            grid.recount();
+            return;
+        }
+        for_each_change(f, [&](uint32_t idx, const entity_t &entity)
+                        {
+            if (idx < cells)
+                grid.set(idx, entity); });
+    }
+
+    // Rebuilds the grid at frame `f` from its nearest keyframe
+    void seek(size_t f, grid_t &grid) const
+    {
+        grid.reset(rows, cols);
+        for (size_t k = keyframe(f); k <= f; k++)
+            apply(k, grid);
+    }
+
+    // Rebuilds the window of frame `f` whose top left cell is (`row`, `col`) into `window`, already sized: only the
+    // window's rows are copied out of the keyframe, and only the window's cells are kept from the deltas after it
+    void seek_region(size_t f, uint32_t row, uint32_t col, grid_t &window) const
+    {
+        size_t k = keyframe(f);
+        const uint8_t *p = mapped + index[k].offset + sizeof(uint64_t);
+        uint64_t cells = (uint64_t)rows * cols;
+        const uint8_t *types = p, *energies = p + cells * sizeof(entity_type_t), *ages = energies + cells * sizeof(int32_t);
+        for (uint32_t r = 0; r < window.rows; r++)
+        {
+            uint64_t from = (uint64_t)(row + r) * cols + col, to = (uint64_t)r * window.cols;
+            std::memcpy(&window.type[to], types + from * sizeof(entity_type_t), window.cols * sizeof(entity_type_t));
+            std::memcpy(&window.energy[to], energies + from * sizeof(int32_t), window.cols * sizeof(int32_t));
+            std::memcpy(&window.age[to], ages + from * sizeof(int32_t), window.cols * sizeof(int32_t));
+        }
+        window.recount();
+        for (k++; k <= f; k++)
+            for_each_change(k, [&](uint32_t idx, const entity_t &entity)
+                            {
+                uint32_t r = idx / cols - row, c = idx % cols - col;
+                if (idx < cells && r < window.rows && c < window.cols)
+                    window.set(r * window.cols + c, entity); });
+    }
+
+private:
+    // Calls `change(idx, entity)` for each cell of the delta frame `f`
+    template <typename F>
+    void for_each_change(size_t f, F change) const
+    {
+        const uint8_t *p = mapped + index[f].offset + sizeof(uint64_t);
+        uint32_t count;
+        std::memcpy(&count, p, sizeof(count));
+        p += sizeof(count);
+        for (uint32_t k = 0; k < count; k++, p += TRAJECTORY_DELTA_BYTES)
+        {
+            uint32_t idx;
+            entity_t entity;
+            std::memcpy(&idx, p, sizeof(idx));
+            std::memcpy(&entity.type, p + 4, sizeof(entity.type));
+            std::memcpy(&entity.energy, p + 5, sizeof(entity.energy));
+            std::memcpy(&entity.age, p + 9, sizeof(entity.age));
+            if (entity.type <= carnivore)
+                change(idx, entity);
+        }
+    }
+
+    std::vector<trajectory_index_entry_t> index;
+    const uint8_t *mapped = nullptr;
+    size_t mapped_size = 0;
+};
@@ -0,0 +1,464 @@
+#pragma once
+
+#include "simulation.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+// Encodings of the grid a client can ask for in its Accept header
+enum wire_format_t
+{
+    JSON_FORMAT,    // application/json, the default
+    MSGPACK_FORMAT, // application/msgpack
+    CBOR_FORMAT,    // application/cbor
+    PACKED_FORMAT,  // application/octet-stream, see pack_frame
+};
+
+// One entry of an Accept or Accept-Encoding header: its media type or coding, lower-cased, and its q-value
+struct accept_entry_t
+{
+    std::string value;
+    double q;
+};
+
+// q-value of a parameter: 0 to 1 with at most three decimals. Anything else reads as 0, so that a malformed
+// entry is not taken as preferred.
+inline double parse_q(const std::string &text)
+{
+    if (text.empty() || (text[0] != '0' && text[0] != '1') || text.size() > 5 || (text.size() > 1 && text[1] != '.') || text.size() == 2)
+        return 0;
+    double q = text[0] - '0', scale = 0.1;
+    for (size_t k = 2; k < text.size(); k++, scale /= 10)
+    {
+        if (!std::isdigit((unsigned char)text[k]))
+            return 0;
+        q += (text[k] - '0') * scale;
+    }
+    return std::min(q, 1.0);
+}
+
+// Entries of a comma-separated Accept-style header. Parameters other than q are dropped; an entry without q has 1.
+inline std::vector<accept_entry_t> parse_accept_list(const std::string &header)
+{
+    auto trim = [](std::string text)
+    {
+        size_t first = text.find_first_not_of(" \t"), last = text.find_last_not_of(" \t");
+        return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+    };
+    std::vector<accept_entry_t> entries;
+    size_t start = 0;
+    while (start <= header.size())
+    {
+        size_t end = std::min(header.find(',', start), header.size());
+        std::string entry = header.substr(start, end - start);
+        start = end + 1;
+
+        size_t semicolon = entry.find(';');
+        accept_entry_t parsed = {trim(entry.substr(0, semicolon)), 1};
+        std::transform(parsed.value.begin(), parsed.value.end(), parsed.value.begin(), [](unsigned char c)
+                       { return (char)std::tolower(c); });
+        while (semicolon != std::string::npos)
+        {
+            size_t next = entry.find(';', semicolon + 1);
+            std::string parameter = trim(entry.substr(semicolon + 1, next == std::string::npos ? std::string::npos : next - semicolon - 1));
+            if (parameter.size() >= 2 && (parameter[0] == 'q' || parameter[0] == 'Q') && parameter[1] == '=')
+                parsed.q = parse_q(parameter.substr(2));
+            semicolon = next;
+        }
+        if (!parsed.value.empty())
+            entries.push_back(std::move(parsed));
+    }
+    return entries;
+}
+
+// q-value the entries give `value`, or failing that the first of `fallbacks` they name; -1 if none is named
+inline double accept_q(const std::vector<accept_entry_t> &entries, const std::string &value, std::initializer_list<const char *> fallbacks = {})
+{
+    for (auto &entry : entries)
+        if (entry.value == value)
+            return entry.q;
+    for (const char *fallback : fallbacks)
+        for (auto &entry : entries)
+            if (entry.value == fallback)
+                return entry.q;
+    return -1;
+}
+
+// The format with the highest q-value; the binary ones only when named, since wildcards such as browsers send
+// stand for JSON. Ties go to the binary formats, JSON being what is left when none is acceptable.
+inline wire_format_t parse_accept(const std::string &accept)
+{
+    auto entries = parse_accept_list(accept);
+    const std::pair<wire_format_t, double> candidates[] = {
+        {MSGPACK_FORMAT, std::max(accept_q(entries, "application/msgpack"), accept_q(entries, "application/x-msgpack"))},
+        {CBOR_FORMAT, accept_q(entries, "application/cbor")},
+        {PACKED_FORMAT, accept_q(entries, "application/octet-stream")},
+        {JSON_FORMAT, accept_q(entries, "application/json", {"application/*", "*/*"})}};
+    wire_format_t best = JSON_FORMAT;
+    double best_q = 0;
+    for (auto &candidate : candidates)
+        if (candidate.second > best_q)
+        {
+            best = candidate.first;
+            best_q = candidate.second;
+        }
+    return best;
+}
+
+// How a whole grid is laid out, chosen with the `layout` query parameter
+enum grid_layout_t
+{
+    DENSE_LAYOUT,  // Every cell, the default
+    SPARSE_LAYOUT, // Only the occupied cells, with their indices
+    AUTO_LAYOUT,   // Sparse or dense per frame, by occupancy
+};
+
+// Occupied share of the grid below which AUTO_LAYOUT sends a frame sparse
+static const double SPARSE_OCCUPANCY = 0.5;
+
+inline grid_layout_t parse_layout(const char *layout)
+{
+    if (!layout)
+        return DENSE_LAYOUT;
+    if (std::strcmp(layout, "sparse") == 0)
+        return SPARSE_LAYOUT;
+    if (std::strcmp(layout, "auto") == 0)
+        return AUTO_LAYOUT;
+    return DENSE_LAYOUT;
+}
+
+// Lists the indices of the occupied cells, skipping empty cells eight at a time
+inline void occupied_cells(const grid_t &grid, std::vector<uint32_t> &cells)
+{
+    static_assert(empty == 0, "empty cells must be zero bytes");
+    cells.clear();
+    uint32_t idx = 0;
+    for (; idx + 8 <= grid.size(); idx += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, &grid.type[idx], sizeof(word));
+        if (word == 0)
+            continue;
+        for (uint32_t k = idx; k < idx + 8; k++)
+            if (grid.type[k] != empty)
+                cells.push_back(k);
+    }
+    for (; idx < grid.size(); idx++)
+        if (grid.type[idx] != empty)
+            cells.push_back(idx);
+}
+
+// Whether a frame of the grid goes out sparse; `cells` gets its occupied cells when it does
+inline bool sparse_frame(grid_layout_t layout, const grid_t &grid, std::vector<uint32_t> &cells)
+{
+    if (layout == DENSE_LAYOUT)
+        return false;
+    occupied_cells(grid, cells);
+    return layout == SPARSE_LAYOUT || cells.size() < SPARSE_OCCUPANCY * grid.size();
+}
+
+// Encoding named in a stream subscription: "json", "msgpack", "cbor" or "packed"
+inline wire_format_t parse_format(const std::string &name)
+{
+    if (name == "msgpack")
+        return MSGPACK_FORMAT;
+    if (name == "cbor")
+        return CBOR_FORMAT;
+    if (name == "packed")
+        return PACKED_FORMAT;
+    return JSON_FORMAT;
+}
+
+inline const char *content_type(wire_format_t format)
+{
+    switch (format)
+    {
+    case MSGPACK_FORMAT:
+        return "application/msgpack";
+    case CBOR_FORMAT:
+        return "application/cbor";
+    case PACKED_FORMAT:
+        return "application/octet-stream";
+    default:
+        return "application/json";
+    }
+}
+
+// Compression of response bodies, negotiated with the Accept-Encoding header
+enum content_encoding_t
+{
+    IDENTITY_ENCODING,
+    GZIP_ENCODING,
+    DEFLATE_ENCODING,
+};
+
+// The coding with the highest q-value, "*" standing for those not named; ties go to gzip, then deflate. Identity,
+// acceptable unless excluded, is only chosen over a compression the client names with a lower q-value, or when
+// none is acceptable.
+inline content_encoding_t parse_accept_encoding(const std::string &accept_encoding)
+{
+    auto entries = parse_accept_list(accept_encoding);
+    const std::pair<content_encoding_t, double> candidates[] = {
+        {GZIP_ENCODING, std::max(accept_q(entries, "gzip", {"*"}), accept_q(entries, "x-gzip"))},
+        {DEFLATE_ENCODING, accept_q(entries, "deflate", {"*"})},
+        {IDENTITY_ENCODING, accept_q(entries, "identity")}};
+    content_encoding_t best = IDENTITY_ENCODING;
+    double best_q = 0;
+    for (auto &candidate : candidates)
+        if (candidate.second > best_q)
+        {
+            best = candidate.first;
+            best_q = candidate.second;
+        }
+    return best;
+}
+
+inline const char *content_encoding_name(content_encoding_t encoding)
+{
+    return encoding == GZIP_ENCODING ? "gzip" : encoding == DEFLATE_ENCODING ? "deflate" : "identity";
+}
+
+// Bytes zlib is handed at a time; its counts are 32-bit, and bodies of huge worlds can be larger
+static const size_t ZLIB_CHUNK_BYTES = 1u << 30;
+
+// Compresses a body in one pass at zlib's fastest level, as frames are compressed while the world keeps
+// stepping; grids still shrink by an order of magnitude. Returns the body itself if zlib fails.
+inline std::string compress_body(const std::string &body, content_encoding_t encoding)
+{
+    if (encoding == IDENTITY_ENCODING)
+        return body;
+    z_stream stream{};
+    // Window bits above 15 ask for a gzip header and trailer instead of the zlib ones
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, encoding == GZIP_ENCODING ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return body;
+    std::string compressed(deflateBound(&stream, body.size()) + 32, '\0');
+    stream.next_in = (Bytef *)body.data();
+    stream.next_out = (Bytef *)&compressed[0];
+    size_t in_left = body.size(), out_left = compressed.size();
+    int code = Z_OK;
+    while (code == Z_OK)
+    {
+        if (stream.avail_in == 0)
+        {
+            stream.avail_in = (uInt)std::min(in_left, ZLIB_CHUNK_BYTES);
+            in_left -= stream.avail_in;
+        }
+        if (stream.avail_out == 0)
+        {
+            stream.avail_out = (uInt)std::min(out_left, ZLIB_CHUNK_BYTES);
+            out_left -= stream.avail_out;
+        }
+        code = deflate(&stream, in_left == 0 ? Z_FINISH : Z_NO_FLUSH);
+    }
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    return code == Z_STREAM_END ? compressed : body;
+}
+
+// Packed frame layout (native byte order):
+//   header: magic "ECOGRID\0", version u32, flags u32 (PACKED_DELTA, PACKED_SPARSE), step u64, rows u32, cols u32, count u32, reserved u32
+//   for a delta or a sparse frame, count cell indices (u32, row-major)
+//   count types (u8, 0 empty, 1 plant, 2 herbivore, 3 carnivore), zero padded to a multiple of 4 bytes
+//   count ages (i32), then count energies (i32)
+// A full frame holds every cell in row-major order, so count is rows * cols and there are no indices. A delta
+// holds the cells changed since the client's step, a sparse frame every occupied cell, the others being empty.
+static const char PACKED_MAGIC[8] = {'E', 'C', 'O', 'G', 'R', 'I', 'D', '\0'};
+static const uint32_t PACKED_VERSION = 1;
+static const uint32_t PACKED_DELTA = 1;
+static const uint32_t PACKED_SPARSE = 2;
+
+// Appends a packed frame of the whole grid, or only of `cells` when given, with `flags` saying which they are
+inline void pack_frame(std::string &out, const grid_t &grid, uint64_t step, const std::vector<uint32_t> *cells = nullptr, uint32_t flags = 0)
+{
+    uint32_t count = cells ? cells->size() : grid.size();
+    uint32_t reserved = 0;
+    uint32_t padding = (4 - count % 4) % 4;
+    size_t start = out.size();
+    out.resize(start + 40 + (cells ? 4 * count : 0) + count + padding + 8 * (size_t)count);
+    char *p = &out[start];
+    auto put = [&](const void *data, size_t size)
+    {
+        std::memcpy(p, data, size);
+        p += size;
+    };
+    put(PACKED_MAGIC, sizeof(PACKED_MAGIC));
+    put(&PACKED_VERSION, 4);
+    put(&flags, 4);
+    put(&step, 8);
+    put(&grid.rows, 4);
+    put(&grid.cols, 4);
+    put(&count, 4);
+    put(&reserved, 4);
+    if (!cells)
+    {
+        put(grid.type.data(), count);
+        std::memset(p, 0, padding);
+        p += padding;
+        put(grid.age.data(), 4 * (size_t)count);
+        put(grid.energy.data(), 4 * (size_t)count);
+        return;
+    }
+    put(cells->data(), 4 * (size_t)count);
+    for (uint32_t idx : *cells)
+        *p++ = grid.type[idx];
+    std::memset(p, 0, padding);
+    p += padding;
+    for (uint32_t idx : *cells)
+        put(&grid.age[idx], 4);
+    for (uint32_t idx : *cells)
+        put(&grid.energy[idx], 4);
+}
+
+// JSON of grids written straight into a byte buffer, byte for byte what nlohmann::json dumps for them
+// (keys sorted, no spaces), without building a document of rows * cols objects first.
+// Longest cells, with their separating comma:
+//   {"age":-2147483648,"energy":-2147483648,"type":" "},
+//   {"age":-2147483648,"col":4294967295,"energy":-2147483648,"row":4294967295,"type":" "},
+static const size_t JSON_CELL_BYTES = 52;
+static const size_t JSON_DELTA_CELL_BYTES = 86;
+static const size_t JSON_NUMBER_BYTES = 20;
+static const char JSON_TYPES[] = " PHC";
+
+template <size_t N>
+inline char *put_literal(char *p, const char (&literal)[N])
+{
+    std::memcpy(p, literal, N - 1);
+    return p + N - 1;
+}
+
+template <typename T>
+inline char *put_number(char *p, T value)
+{
+    return std::to_chars(p, p + JSON_NUMBER_BYTES, value).ptr;
+}
+
+inline char *write_json_cell(char *p, const grid_t &grid, uint32_t idx)
+{
+    p = put_number(put_literal(p, "{\"age\":"), grid.age[idx]);
+    p = put_number(put_literal(p, ",\"energy\":"), grid.energy[idx]);
+    p = put_literal(p, ",\"type\":\" \"}");
+    p[-3] = JSON_TYPES[grid.type[idx]];
+    return p;
+}
+
+// Upper bound of the bytes written by write_json_grid
+inline size_t json_grid_bytes(const grid_t &grid)
+{
+    return 2 + 3 * (size_t)grid.rows + JSON_CELL_BYTES * (size_t)grid.size();
+}
+
+inline size_t json_number_bytes(int64_t value)
+{
+    size_t bytes = value < 0 ? 2 : 1;
+    for (uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : value; magnitude >= 10; magnitude /= 10)
+        bytes++;
+    return bytes;
+}
+
+// Exact number of bytes write_json_rows writes for rows [first, last)
+inline size_t json_rows_bytes(const grid_t &grid, uint32_t first, uint32_t last)
+{
+    // A row is its separating comma (but the first), brackets, and cells separated by commas; without its
+    // numbers a cell is {"age":,"energy":,"type":" "}, 29 bytes
+    size_t bytes = (last - first) * (3 + (size_t)grid.cols * 30) - (first == 0 && last > 0);
+    for (uint32_t idx = grid.index(first, 0); idx < grid.index(last, 0); idx++)
+        bytes += json_number_bytes(grid.age[idx]) + json_number_bytes(grid.energy[idx]);
+    return bytes - (last - first) * (grid.cols > 0);
+}
+
+// Writes rows [first, last) of the grid's JSON, each an array of {"age", "energy", "type"} cells preceded by a
+// comma unless it is the first row, so that consecutive bands written apart join up
+inline char *write_json_rows(char *p, const grid_t &grid, uint32_t first, uint32_t last)
+{
+    for (uint32_t i = first; i < last; i++)
+    {
+        if (i > 0)
+            *p++ = ',';
+        *p++ = '[';
+        for (uint32_t j = 0, idx = grid.index(i, 0); j < grid.cols; j++, idx++)
+        {
+            if (j > 0)
+                *p++ = ',';
+            p = write_json_cell(p, grid, idx);
+        }
+        *p++ = ']';
+    }
+    return p;
+}
+
+// Writes the grid as an array of rows, returning the end of what was written
+inline char *write_json_grid(char *p, const grid_t &grid)
+{
+    *p++ = '[';
+    p = write_json_rows(p, grid, 0, grid.rows);
+    *p++ = ']';
+    return p;
+}
+
+// Upper bound of the bytes written by write_json_cells for `count` cells
+inline size_t json_cells_bytes(size_t count)
+{
+    return 2 + JSON_DELTA_CELL_BYTES * count;
+}
+
+// Writes the listed cells as an array of {"age", "col", "energy", "row", "type"} objects
+inline char *write_json_cells(char *p, const grid_t &grid, const std::vector<uint32_t> &cells)
+{
+    *p++ = '[';
+    for (size_t k = 0; k < cells.size(); k++)
+    {
+        uint32_t idx = cells[k];
+        if (k > 0)
+            *p++ = ',';
+        p = put_number(put_literal(p, "{\"age\":"), grid.age[idx]);
+        p = put_number(put_literal(p, ",\"col\":"), idx % grid.cols);
+        p = put_number(put_literal(p, ",\"energy\":"), grid.energy[idx]);
+        p = put_number(put_literal(p, ",\"row\":"), idx / grid.cols);
+        p = put_literal(p, ",\"type\":\" \"}");
+        p[-3] = JSON_TYPES[grid.type[idx]];
+    }
+    *p++ = ']';
+    return p;
+}
+
+// Upper bound of the bytes written by write_json_sparse for `count` cells
+inline size_t json_sparse_bytes(size_t count)
+{
+    // Longest tuple, with its separating comma: [4294967295,"P",-2147483648,-2147483648],
+    return 2 + 41 * count;
+}
+
+// Writes the listed cells as an array of [index, type, age, energy] tuples
+inline char *write_json_sparse(char *p, const grid_t &grid, const std::vector<uint32_t> &cells)
+{
+    *p++ = '[';
+    for (size_t k = 0; k < cells.size(); k++)
+    {
+        uint32_t idx = cells[k];
+        if (k > 0)
+            *p++ = ',';
+        p = put_literal(put_number(put_literal(p, "["), idx), ",\" \",");
+        p[-3] = JSON_TYPES[grid.type[idx]];
+        p = put_number(put_literal(put_number(p, grid.age[idx]), ","), grid.energy[idx]);
+        *p++ = ']';
+    }
+    *p++ = ']';
+    return p;
+}
+
+// Scratch buffer of at least `bytes` bytes for the JSON writers, kept per thread so frames after the first
+// reuse it instead of allocating; bodies are copied out of it at their exact size
+inline char *json_scratch(size_t bytes)
+{
+    static thread_local std::string scratch;
+    if (scratch.size() < bytes)
+        scratch.resize(bytes);
+    return &scratch[0];
+}